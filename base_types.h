@@ -3,12 +3,19 @@
 
 struct lval;
 struct lenv;
+struct lcode;
+struct lcells;
 
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lcells lcells;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* a builtin given its arguments as an array, see LVAL_F_ARGV */
+typedef lval*(*lbuiltin_argv)(lenv*, int, lval**);
+
 /* basic user types of Lispy */
 typedef enum {
         LVAL_NUM,
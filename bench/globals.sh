@@ -0,0 +1,7 @@
+#!/bin/sh
+# Emits $1 global definitions g0 .. g<n-1> for bench/globals.lispy,
+# followed by 'last', bound to the value of the final one.
+awk -v n="$1" 'BEGIN {
+        for (i = 0; i < n; i++) printf "(def {g%d} %d)\n", i, i
+        printf "(def {last} g%d)\n", n - 1
+}'
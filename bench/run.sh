@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Runs every bench/*.lispy once for each size listed in its "; sizes:"
+# header line. The size is bound to 'n' before the benchmark is loaded.
+# If bench/<name>.sh exists, its output for 'n' is loaded first; use it
+# for setup that Lispy cannot express, like generating definitions.
+# Prints wall-clock time per run plus the last line the benchmark
+# printed, so both scaling and the result can be checked at a glance.
+#
+# usage: bench/run.sh [benchmark.lispy ...]
+#
+# LISPY selects the interpreter binary and LISPY_FLAGS passes options to
+# it, e.g. LISPY_FLAGS=--vm to run everything on the bytecode VM.
+
+LISPY=${LISPY:-./lispy}
+
+if [ $# -eq 0 ]; then
+        set -- bench/*.lispy
+fi
+
+for bench in "$@"; do
+        name=$(basename "$bench" .lispy)
+        sizes=$(sed -n 's/^; sizes: *//p' "$bench")
+
+        for n in $sizes; do
+                driver=$(mktemp)
+                setup=$(mktemp)
+                generator="${bench%.lispy}.sh"
+
+                if [ -f "$generator" ]; then
+                        sh "$generator" "$n" > "$setup"
+                fi
+
+                printf '(def {n} %s)\n(load "%s")\n(load "%s")\n' "$n" "$setup" "$bench" > "$driver"
+
+                start=$(date +%s.%N)
+                result=$("$LISPY" $LISPY_FLAGS "$driver" | tail -n 1)
+                end=$(date +%s.%N)
+
+                rm -f "$driver" "$setup"
+
+                awk -v name="$name" -v n="$n" -v s="$start" -v e="$end" -v r="$result" \
+                        'BEGIN { printf "%-24s n=%-9s %8.3fs   %s\n", name, n, e - s, r }'
+        done
+done
@@ -1,9 +1,13 @@
+#include <limits.h>
 #include <stdlib.h>
 
 #include "mpc.h"
 #include "parsers.h"
 #include "builtin.h"
 #include "eval.h"
+#include "larena.h"
+#include "vm.h"
+#include "lreduce.h"
 
 /* BUILTIN MATHEMATICAL FUNCTIONS */
 
@@ -15,9 +19,9 @@
         }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-                LASSERT(args, args->cell[index]->type == expect, \
+                LASSERT(args, LTYPE(args->cell[index]) == expect, \
                 "Function '%s' passed incorrect type of argument %d. Got %s, expected %s", \
-                func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+                func, index, ltype_name(LTYPE(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
                 LASSERT(args, args->count == num, \
@@ -31,235 +35,240 @@
                 LASSERT(args, args->count != 0, \
                 "Function '%s' passed {} for argument %d", func, index)
 
-lval * builtin_op(lenv * e, lval * v, char * op) {
-        for (int i = 0; i < v->count; i++) {
-                LASSERT_TYPE(op, v, i, LVAL_NUM);
-        }
-
-        lval * x = lval_pop(v, 0);
-
-        if ((strcmp(op, "-") == 0) && v->count == 0)
-                x->num = - x->num;
-
-        while (v->count > 0) {
-
-                lval * y = lval_pop(v, 0);
-
-                if (strcmp(op, "+") == 0) x->num += y->num;
-                if (strcmp(op, "-") == 0) x->num -= y->num;
-                if (strcmp(op, "*") == 0) x->num *= y->num;
-                if (strcmp(op, "/") == 0) {
-                        if (y->num == 0) {
-                                lval_del(x);
-                                lval_del(y);
-                                x = lval_err("Division By Zero!");
-                                break;
-                        }
-
-                        x->num /= y->num;
-                }
-                if (strcmp(op, "%") == 0) {
-                        if (y->num == 0) {
-                                lval_del(x);
-                                lval_del(y);
-                                x = lval_err("Division By Zero!");
-                                break;
-                        }
-
-                        x->num %= y->num;
-                }
-                if (strcmp(op, "^") == 0) x->num = (int)pow(x->num, y->num);
-                if (strcmp(op, "max") == 0) {
-                        if (x->num < y->num) {
-                                x->num = y->num;
-                        }
-                }
-                if (strcmp(op, "min") == 0) {
-                        if (x->num > y->num) {
-                                x->num = y->num;
-                        }
-                }
-
-                lval_del(y);
+/* the same for builtins taking argc and argv */
 
+#define LASSERT_ARGV(argc, argv, cond, fmt, ...) \
+        if (!(cond)) { \
+                lval * err = lval_err(fmt, ##__VA_ARGS__) ; \
+                lval_del_argv(argc, argv); \
+                return err; \
         }
 
-        lval_del(v);
-
-        return x;
-}
+#define LASSERT_ARGV_TYPE(func, argc, argv, index, expect) \
+                LASSERT_ARGV(argc, argv, LTYPE(argv[index]) == expect, \
+                "Function '%s' passed incorrect type of argument %d. Got %s, expected %s", \
+                func, index, ltype_name(LTYPE(argv[index])), ltype_name(expect))
 
-lval * builtin_add(lenv * e, lval * a) {
-        return builtin_op(e, a, "+");
-}
+#define LASSERT_ARGV_NUM(func, argc, argv, num) \
+                LASSERT_ARGV(argc, argv, argc == num, \
+                "Function '%s' passed incorrect number of arguments. Got %d, expected %d", func, argc, num)
 
-lval * builtin_sub(lenv * e, lval * a) {
-        return builtin_op(e, a, "-");
-}
+#define LASSERT_ARGV_NUM_AT_LEAST(func, argc, argv, num) \
+                LASSERT_ARGV(argc, argv, argc >= num, \
+                "Function '%s' passed incorrect number of arguments. Got %d, expected %d or greater", func, argc, num)
 
-lval * builtin_mul(lenv * e, lval * a) {
-        return builtin_op(e, a, "*");
-}
+/* x to the power y >= 0, by squaring; true if it doesn't fit in a long */
+static int builtin_power_overflow(long * x, long y) {
+        long base = *x;
+        long result = 1;
 
-lval * builtin_div(lenv * e, lval * a) {
-        return builtin_op(e, a, "/");
-}
+        for (;;) {
+                if ((y & 1) && __builtin_mul_overflow(result, base, &result)) return 1;
 
-lval * builtin_mod(lenv * e, lval * a) {
-        return builtin_op(e, a, "\%");
-}
+                y >>= 1;
+                if (y == 0) break;
 
-lval * builtin_power(lenv * e, lval * a) {
-        return builtin_op(e, a, "^");
-}
+                // y has bits left, so |result| will be at least |base * base|
+                if (__builtin_mul_overflow(base, base, &base)) return 1;
+        }
 
-lval * builtin_max(lenv * e, lval * a) {
-        return builtin_op(e, a, "max");
-}
+        *x = result;
+        return 0;
+}
+
+/*
+ * One kernel per operator, generated from BUILTIN_ARITH_OPS. Two
+ * numbers, by far the most common call, take the fast path. Longer
+ * lists of fixnums are reduced in one pass by 'reduce'; anything else
+ * is checked argument by argument and folded left to right.
+ */
+#define BUILTIN_ARITH_KERNEL(name, sym, domain, unary, fold, reduce) \
+        lval * builtin_##name(lenv * e, int argc, lval ** argv) { \
+                if (argc == 2 && \
+                        LTYPE(argv[0]) == LVAL_NUM && LTYPE(argv[1]) == LVAL_NUM) { \
+                        long x = LNUM(argv[0]); \
+                        long y = LNUM(argv[1]); \
+                        lval_del(argv[0]); \
+                        lval_del(argv[1]); \
+                        if (domain) return lval_err("%s", domain); \
+                        if (fold) return lval_err("Integer Overflow!"); \
+                        return lval_num(x); \
+                } \
+ \
+                long x; \
+ \
+                if (argc > 2 && reduce(argc, argv, &x)) return lval_num(x); \
+ \
+                LASSERT_ARGV_NUM_AT_LEAST(sym, argc, argv, 1); \
+ \
+                for (int i = 0; i < argc; i++) \
+                        LASSERT_ARGV_TYPE(sym, argc, argv, i, LVAL_NUM); \
+ \
+                x = LNUM(argv[0]); \
+ \
+                int overflow = argc == 1 && (unary); \
+ \
+                for (int i = 1; !overflow && i < argc; i++) { \
+                        long y = LNUM(argv[i]); \
+ \
+                        if (domain) { \
+                                lval_del_argv(argc, argv); \
+                                return lval_err("%s", domain); \
+                        } \
+ \
+                        overflow = fold; \
+                } \
+ \
+                lval_del_argv(argc, argv); \
+ \
+                if (overflow) return lval_err("Integer Overflow!"); \
+                return lval_num(x); \
+        }
 
-lval * builtin_min(lenv * e, lval * a) {
-        return builtin_op(e, a, "min");
-}
+BUILTIN_ARITH_OPS(BUILTIN_ARITH_KERNEL)
 
 /* BUILTIN FUNCTIONS */
 
 /* builtin 'head' variants */
-lval * builtin_head_str(lenv * e, lval * v) {
-        if (strlen(v->cell[0]->str) == 0) return lval_str("");
-
+lval * builtin_head_str(lenv * e, lval * str) {
         char tmp[] = " ";
-        tmp[0] = v->cell[0]->str[0];
+        tmp[0] = str->str[0];
 
-        return lval_str(tmp);
-}
+        lval * x = lval_str(tmp);
 
-lval * builtin_head_qexpr(lenv * e, lval * v) {
-        lval * x = lval_take(v, 0);
+        lval_del(str);
+        return x;
+}
 
-        while (x->count > 1) lval_del(lval_pop(x, 1));
+lval * builtin_head_qexpr(lenv * e, lval * x) {
+        if (x->count > 1) x = lval_slice(x, 0, 1);
         return x;
 }
 
-lval * builtin_head(lenv * e, lval * v) {
-        LASSERT_NUM("head", v, 1);
-        LASSERT_NOT_EMPTY("head", v, 0);
+lval * builtin_head(lenv * e, int argc, lval ** argv) {
+        LASSERT_ARGV_NUM("head", argc, argv, 1);
 
-        if (v->cell[0]->type == LVAL_STR) return builtin_head_str(e, v);
-        if (v->cell[0]->type == LVAL_QEXPR) return builtin_head_qexpr(e, v);
+        if (LTYPE(argv[0]) == LVAL_STR) return builtin_head_str(e, argv[0]);
+        if (LTYPE(argv[0]) == LVAL_QEXPR) return builtin_head_qexpr(e, argv[0]);
 
         lval * err = lval_err(
                 "Function 'head' passed incorrect type of argument 0. Got %s, expected %s or %s",
-                ltype_name(v->cell[0]->type),
+                ltype_name(LTYPE(argv[0])),
                 ltype_name(LVAL_STR),
                 ltype_name(LVAL_QEXPR)
         );
 
-        lval_del(v);
+        lval_del_argv(argc, argv);
 
         return err;
 
 }
 
 /* builtin 'tail' variants */
-lval * builtin_tail_str(lenv * e, lval * v) {
-        if (strlen(v->cell[0]->str) == 0) return lval_str("");
+lval * builtin_tail_str(lenv * e, lval * str) {
+        lval * x = lval_str(str->str[0] == '\0' ? "" : str->str + 1);
 
-        return lval_str(v->cell[0]->str + 1);
+        lval_del(str);
+        return x;
 }
 
-lval * builtin_tail_qexpr(lenv * e, lval * v) {
-        lval * x = lval_take(v, 0);
-
-        lval_del(lval_pop(x, 0));
+lval * builtin_tail_qexpr(lenv * e, lval * x) {
+        if (x->count > 0) x = lval_slice(x, 1, x->count - 1);
 
         return x;
 }
 
-lval * builtin_tail(lenv * e, lval * v) {
-        LASSERT_NUM("tail", v, 1);
-        LASSERT_NOT_EMPTY("tail", v, 0);
+lval * builtin_tail(lenv * e, int argc, lval ** argv) {
+        LASSERT_ARGV_NUM("tail", argc, argv, 1);
 
-        if (v->cell[0]->type == LVAL_STR) return builtin_tail_str(e, v);
-        if (v->cell[0]->type == LVAL_QEXPR) return builtin_tail_qexpr(e, v);
+        if (LTYPE(argv[0]) == LVAL_STR) return builtin_tail_str(e, argv[0]);
+        if (LTYPE(argv[0]) == LVAL_QEXPR) return builtin_tail_qexpr(e, argv[0]);
 
         lval * err = lval_err(
                 "Function 'tail' passed incorrect type of argument 0. Got %s, expected %s or %s",
-                ltype_name(v->cell[0]->type),
+                ltype_name(LTYPE(argv[0])),
                 ltype_name(LVAL_STR),
                 ltype_name(LVAL_QEXPR)
         );
 
-        lval_del(v);
+        lval_del_argv(argc, argv);
 
         return err;
 }
 
-lval * builtin_list(lenv * e, lval * v) {
-        v->type = LVAL_QEXPR;
-        return v;
+lval * builtin_list(lenv * e, int argc, lval ** argv) {
+        lval * x = lval_reserve(lval_qexpr(), argc);
+
+        for (int i = 0; i < argc; i++)
+                lval_add(x, argv[i]);
+
+        return x;
 }
 
-lval * builtin_eval(lenv * e, lval * v) {
-        LASSERT_NUM("eval", v, 1);
-        LASSERT_TYPE("eval", v, 0, LVAL_QEXPR);
+lval * builtin_eval(lenv * e, int argc, lval ** argv) {
+        LASSERT_ARGV_NUM("eval", argc, argv, 1);
+        LASSERT_ARGV_TYPE("eval", argc, argv, 0, LVAL_QEXPR);
 
-        lval * x = lval_take(v, 0);
-        x->type = LVAL_SEXPR;
-        return lval_eval(e, x);
+        lval * x = lval_eval_list(e, argv[0]);
+        lval_del(argv[0]);
+        return x;
 }
 
 /* builtin 'join' variants */
-lval * builtin_join_str(lenv * e, lval * v) {
-        for (int i = 0; i < v->count; i++)
-                LASSERT_TYPE("join", v, i, LVAL_STR);
+lval * builtin_join_str(lenv * e, int argc, lval ** argv) {
+        for (int i = 0; i < argc; i++)
+                LASSERT_ARGV_TYPE("join", argc, argv, i, LVAL_STR);
 
         int len_sum = 0;
 
-        for (int i = 0; i < v->count; i++)
-                len_sum += strlen(v->cell[i]->str);
+        for (int i = 0; i < argc; i++)
+                len_sum += strlen(argv[i]->str);
 
         char * buffer = calloc(len_sum + 1, 1);
 
-        for (int i = 0; i < v->count; i++)
-                strcpy(buffer + strlen(buffer), v->cell[i]->str);
+        for (int i = 0; i < argc; i++)
+                strcpy(buffer + strlen(buffer), argv[i]->str);
 
         lval * str = lval_str(buffer);
 
         free(buffer);
 
-        lval_del(v);
+        lval_del_argv(argc, argv);
 
         return str;
 }
 
-lval * builtin_join_qexpr(lenv * e, lval * v) {
-        for (int i = 0; i < v->count; i++)
-                LASSERT_TYPE("join", v, i, LVAL_QEXPR);
+lval * builtin_join_qexpr(lenv * e, int argc, lval ** argv) {
+        for (int i = 0; i < argc; i++)
+                LASSERT_ARGV_TYPE("join", argc, argv, i, LVAL_QEXPR);
 
-        lval * x = lval_pop(v, 0);
+        int total = 0;
 
-        while(v->count)
-                x = lval_join(x, lval_pop(v, 0));
+        for (int i = 0; i < argc; i++)
+                total += argv[i]->count;
 
-        lval_del(v);
+        lval * x = lval_reserve(argv[0], total);
+
+        for (int i = 1; i < argc; i++)
+                x = lval_join(x, argv[i]);
 
         return x;
 }
 
-lval * builtin_join(lenv * e, lval * v) {
-        LASSERT_NUM_AT_LEAST("join", v, 1);
+lval * builtin_join(lenv * e, int argc, lval ** argv) {
+        LASSERT_ARGV_NUM_AT_LEAST("join", argc, argv, 1);
 
-        if (v->cell[0]->type == LVAL_STR) return builtin_join_str(e, v);
-        if (v->cell[0]->type == LVAL_QEXPR) return builtin_join_qexpr(e, v);
+        if (LTYPE(argv[0]) == LVAL_STR) return builtin_join_str(e, argc, argv);
+        if (LTYPE(argv[0]) == LVAL_QEXPR) return builtin_join_qexpr(e, argc, argv);
 
         lval * err = lval_err(
                 "Function 'join' passed incorrect type of argument 0. Got %s, expected %s or %s",
-                ltype_name(v->cell[0]->type),
+                ltype_name(LTYPE(argv[0])),
                 ltype_name(LVAL_STR),
                 ltype_name(LVAL_QEXPR)
         );
 
-        lval_del(v);
+        lval_del_argv(argc, argv);
 
         return err;
 }
@@ -270,15 +279,15 @@ lval * builtin_lambda(lenv * e, lval * v) {
         LASSERT_TYPE("\\", v, 1, LVAL_QEXPR);
 
         for (int i = 0; i < v->cell[0]->count; i++)
-                LASSERT(v, (v->cell[0]->cell[i]->type == LVAL_SYM),
+                LASSERT(v, (LTYPE(v->cell[0]->cell[i]) == LVAL_SYM),
                 "Cannot define non-symbol. Got %s, Expected %s.",
-                ltype_name(v->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+                ltype_name(LTYPE(v->cell[0]->cell[i])), ltype_name(LVAL_SYM));
 
-        lval * formals = lval_pop(v, 0);
-        lval * body = lval_pop(v, 0);
+        lval * func = lval_lambda(v->cell[0], v->cell[1]);
+        lenv_capture(e, func);
         lval_del(v);
 
-        return lval_lambda(formals, body);
+        return func;
 }
 
 lval * builtin_def(lenv * e, lval * v) {
@@ -295,11 +304,11 @@ lval * builtin_var(lenv* e, lval * v, char* func) {
         lval * syms = v->cell[0];
 
         for (int i = 0; i < syms->count; i++) {
-                LASSERT(v, (syms->cell[i]->type == LVAL_SYM),
+                LASSERT(v, (LTYPE(syms->cell[i]) == LVAL_SYM),
                 "Function '%s' cannot define non-symbol. "
                 "Got %s, Expected %s.",
                 func,
-                ltype_name(syms->cell[i]->type),
+                ltype_name(LTYPE(syms->cell[i])),
                 ltype_name(LVAL_SYM)
                 );
         }
@@ -336,121 +345,114 @@ lval * builtin_fun(lenv * e, lval * v) {
         LASSERT_TYPE("fun", v, 1, LVAL_QEXPR);
 
         for (int i = 0; i < v->cell[0]->count; i++) {
-                LASSERT(v, (v->cell[0]->cell[i]->type == LVAL_SYM),
+                LASSERT(v, (LTYPE(v->cell[0]->cell[i]) == LVAL_SYM),
                 "Function 'fun' cannot define non-symbol. "
                 "Got %s, expected %s",
-                ltype_name(v->cell[0]->cell[i]->type),
+                ltype_name(LTYPE(v->cell[0]->cell[i])),
                 ltype_name(LVAL_SYM)
                 );
         }
 
         LASSERT(v, v->cell[0]->count != 0, "Function 'fun' first argument cannot be '{}'");
 
+        // the formals may be shared with the caller's list
+        v->cell[0] = lval_own(v->cell[0]);
+
         lval * func_name = lval_pop(v->cell[0], 0);
         lval * formals = v->cell[0];
         lval * body = v->cell[1];
+        lval * func = lval_lambda(formals, body);
+
+        lenv_capture(e, func);
+        lenv_def(e, func_name, func);
 
-        lenv_def(e, func_name, lval_lambda(formals, body));
+        lval_del(func);
+        lval_del(func_name);
+        lval_del(v);
 
         return lval_sexpr();
 }
 
 /* ordering functions */
 
-lval * builtin_ord(lenv * e, lval * v, char * op) {
-        LASSERT_NUM(op, v, 2);
-        LASSERT_TYPE(op, v, 0, LVAL_NUM);
-        LASSERT_TYPE(op, v, 1, LVAL_NUM);
-
-        int r;
-
-        if (strcmp(op, ">") == 0)
-                r = v->cell[0]->num > v->cell[1]->num;
-        if (strcmp(op, ">=") == 0)
-                r = v->cell[0]->num >= v->cell[1]->num;
-        if (strcmp(op, "<") == 0)
-                r = v->cell[0]->num < v->cell[1]->num;
-        if (strcmp(op, "<=") == 0)
-                r = v->cell[0]->num <= v->cell[1]->num;
-
-        lval_del(v);
-        return lval_num(r);
-}
-
-lval * builtin_gt(lenv * e, lval * v) {
-        return builtin_ord(e, v, ">");
-}
+#define BUILTIN_ORD_KERNEL(name, sym, test) \
+        lval * builtin_##name(lenv * e, int argc, lval ** argv) { \
+                LASSERT_ARGV_NUM(sym, argc, argv, 2); \
+                LASSERT_ARGV_TYPE(sym, argc, argv, 0, LVAL_NUM); \
+                LASSERT_ARGV_TYPE(sym, argc, argv, 1, LVAL_NUM); \
+ \
+                long x = LNUM(argv[0]); \
+                long y = LNUM(argv[1]); \
+ \
+                lval_del(argv[0]); \
+                lval_del(argv[1]); \
+                return lval_num(test); \
+        }
 
-lval * builtin_ge(lenv * e, lval * v) {
-        return builtin_ord(e, v, ">=");
-}
+BUILTIN_ORD_OPS(BUILTIN_ORD_KERNEL)
 
-lval * builtin_lt(lenv * e, lval * v) {
-        return builtin_ord(e, v, "<");
-}
+/* equality functions */
 
-lval * builtin_le(lenv * e, lval * v) {
-        return builtin_ord(e, v, "<=");
-}
-
-lval * builtin_cmp(lenv * e, lval * v, char * op) {
-        LASSERT_NUM(op, v, 2);
+#define BUILTIN_EQ_KERNEL(name, sym, test) \
+        lval * builtin_##name(lenv * e, int argc, lval ** argv) { \
+                LASSERT_ARGV_NUM(sym, argc, argv, 2); \
+ \
+                int eq = lval_eq(argv[0], argv[1]); \
+ \
+                lval_del(argv[0]); \
+                lval_del(argv[1]); \
+                return lval_num(test); \
+        }
 
-        int r;
-        if (strcmp(op, "==") == 0) r = lval_eq(v->cell[0], v->cell[1]);
-        if (strcmp(op, "!=") == 0) r = lval_eq(v->cell[0], v->cell[1]);
+BUILTIN_EQ_OPS(BUILTIN_EQ_KERNEL)
 
-        lval_del(v);
-        return lval_num(r);
-}
-
-lval * builtin_eq(lenv * e, lval * v) {
-        return builtin_cmp(e, v, "==");
-}
+/* logical operators */
+lval * builtin_logical_and(lenv * e, int argc, lval ** argv) {
+        LASSERT_ARGV_NUM_AT_LEAST("&&", argc, argv, 2);
 
-lval * builtin_ne(lenv * e, lval * v) {
-        return builtin_cmp(e, v, "!=");
-}
+        long all;
 
-/* logical operators */
-lval * builtin_logical_and(lenv * e, lval * v) {
-        LASSERT_NUM_AT_LEAST("&&", v, 2);
+        if (lreduce_all(argc, argv, &all)) return lval_num(all);
 
-        for (int i = 0; i < v->count; i++)
-                LASSERT_TYPE("&&", v, i, LVAL_NUM);
+        for (int i = 0; i < argc; i++)
+                LASSERT_ARGV_TYPE("&&", argc, argv, i, LVAL_NUM);
 
         int r = 1;
 
-        for (int i = 0; i < v->count; i++)
-                r = r && v->cell[i]->num;
+        for (int i = 0; i < argc; i++)
+                r = r && LNUM(argv[i]);
 
-        lval_del(v);
+        lval_del_argv(argc, argv);
         return lval_num(r);
 }
 
-lval * builtin_logical_or(lenv * e, lval * v) {
-        LASSERT_NUM_AT_LEAST("||", v, 2);
+lval * builtin_logical_or(lenv * e, int argc, lval ** argv) {
+        LASSERT_ARGV_NUM_AT_LEAST("||", argc, argv, 2);
+
+        long any;
+
+        if (lreduce_any(argc, argv, &any)) return lval_num(any);
 
-        for (int i = 0; i < v->count; i++)
-                LASSERT_TYPE("||", v, i, LVAL_NUM);
+        for (int i = 0; i < argc; i++)
+                LASSERT_ARGV_TYPE("||", argc, argv, i, LVAL_NUM);
 
 
         int r = 0;
 
-        for (int i = 0; i < v->count; i++)
-                r = r || v->cell[i]->num;
+        for (int i = 0; i < argc; i++)
+                r = r || LNUM(argv[i]);
 
-        lval_del(v);
+        lval_del_argv(argc, argv);
         return lval_num(r);
 }
 
-lval * builtin_logical_not(lenv * e, lval * v) {
-        LASSERT_NUM("!", v, 1);
-        LASSERT_TYPE("!", v, 0, LVAL_NUM);
+lval * builtin_logical_not(lenv * e, int argc, lval ** argv) {
+        LASSERT_ARGV_NUM("!", argc, argv, 1);
+        LASSERT_ARGV_TYPE("!", argc, argv, 0, LVAL_NUM);
 
-        int r = !v->cell[0]->num;
+        int r = !LNUM(argv[0]);
 
-        lval_del(v);
+        lval_del_argv(argc, argv);
         return lval_num(r);
 }
 
@@ -468,13 +470,10 @@ lval * builtin_if(lenv * e, lval * v) {
         // if else branch is present
         if (v->count == 3) LASSERT_TYPE("if", v, 2, LVAL_QEXPR);
 
-        lval * cond_expr = lval_pop(v, 0);
+        // the branches are evaluated in place, without copying them
+        lval * cond_res = lval_eval_list(e, v->cell[0]);
 
-        cond_expr->type = LVAL_SEXPR;
-
-        lval * cond_res = lval_eval(e, cond_expr);
-
-        if (cond_res->type == LVAL_ERR) {
+        if (LTYPE(cond_res) == LVAL_ERR) {
                 lval_del(v);
                 return cond_res;
         }
@@ -482,18 +481,17 @@ lval * builtin_if(lenv * e, lval * v) {
         lval * branch; // if or else branch
 
         // treat not number like TRUE
-        if (cond_res->type != LVAL_NUM) branch = lval_pop(v, 0);
-        else if (cond_res->num != 0) branch = lval_pop(v, 0);
-        else if (v->count == 2) branch = lval_pop(v, 1);
+        if (LTYPE(cond_res) != LVAL_NUM) branch = v->cell[1];
+        else if (LNUM(cond_res) != 0) branch = v->cell[1];
+        else if (v->count == 3) branch = v->cell[2];
         else branch = NULL;
 
-        lval_del(v);
         lval_del(cond_res);
 
-        if (branch == NULL) return lval_sexpr();
+        lval * result = branch == NULL ? lval_sexpr() : lval_eval_list(e, branch);
 
-        branch->type = LVAL_SEXPR;
-        return lval_eval(e, branch);
+        lval_del(v);
+        return result;
 }
 
 lval * builtin_load(lenv * e, lval * v) {
@@ -507,10 +505,16 @@ lval * builtin_load(lenv * e, lval * v) {
                 lval * expr = lval_read(r.output);
                 mpc_ast_delete(r.output);
 
-                while (expr->count) {
-                        lval * x = lval_eval(e, lval_pop(expr, 0));
-                        if (x->type == LVAL_ERR) lval_println(x);
+                for (int i = 0; i < expr->count; i++) {
+                        larena_begin();
+
+                        lval * x = vm_enabled
+                                ? vm_eval(e, expr->cell[i])
+                                : lval_eval_tree(e, expr->cell[i]);
+                        if (LTYPE(x) == LVAL_ERR) lval_println(x);
                         lval_del(x);
+
+                        larena_end();
                 }
 
                 lval_del(expr);
@@ -552,3 +556,20 @@ lval * builtin_error(lenv * e, lval * v) {
 
         return err;
 }
+
+/* the function values of BUILTINS, read-only and shared by every copy */
+
+#define BUILTIN_FIELD_ARGV .builtin_argv
+#define BUILTIN_FIELD_SEXPR .builtin
+#define BUILTIN_FLAGS_ARGV (LVAL_F_BUILTIN | LVAL_F_STATIC | LVAL_F_ARGV)
+#define BUILTIN_FLAGS_SEXPR (LVAL_F_BUILTIN | LVAL_F_STATIC)
+
+#define BUILTIN_VALUE(sym, name, abi) { \
+                .type = LVAL_FUN, \
+                .flags = BUILTIN_FLAGS_##abi, \
+                BUILTIN_FIELD_##abi = builtin_##name, \
+                .builtin_name = sym \
+        },
+
+const lval builtin_values[] = { BUILTINS(BUILTIN_VALUE) };
+const int builtin_count = sizeof(builtin_values) / sizeof(builtin_values[0]);
@@ -5,53 +5,105 @@
 #include "lenv.h"
 #include "parsers.h"
 
-/* BUILTIN FUNCTIONS */
-
-/* Mathematical functions */
-
-lval * builtin_add(lenv * e, lval * a);
-lval * builtin_sub(lenv * e, lval * a);
-lval * builtin_mul(lenv * e, lval * a);
-lval * builtin_div(lenv * e, lval * a);
-lval * builtin_mod(lenv * e, lval * a);
-lval * builtin_power(lenv * e, lval * a);
-lval * builtin_max(lenv * e, lval * a);
-lval * builtin_min(lenv * e, lval * a);
-
-/* List functions */
-lval * builtin_head(lenv * e, lval * v);
-lval * builtin_tail(lenv * e, lval * v);
-lval * builtin_list(lenv * e, lval * v);
-lval * builtin_eval(lenv * e, lval * v);
-lval * builtin_join(lenv * e, lval * v);
-
-/* define functions */
-lval * builtin_lambda(lenv * e, lval * v);
-lval * builtin_def(lenv * e, lval * v);
-lval * builtin_put(lenv * e, lval * v);
-lval * builtin_var(lenv* e, lval * v, char* func);
-lval * builtin_fun(lenv * e, lval * v);
+/*
+ * BUILTIN FUNCTIONS
+ *
+ * Arithmetic, comparison, logical and list functions are lbuiltin_argv:
+ * they take over the values in argv but leave the array to the caller,
+ * so calling them allocates no argument list. The rest take an
+ * S-Expression of their arguments and free it.
+ *
+ * X(symbol, name, abi) for every builtin bound in the global
+ * environment: builtin_<name>, taking argc and argv if 'abi' is ARGV or
+ * an S-Expression if it is SEXPR. Their function values are the static
+ * builtin_values, which are never copied or freed.
+ */
+#define BUILTINS(X) \
+        /* List functions */ \
+        X("list",  list,          ARGV) \
+        X("head",  head,          ARGV) \
+        X("tail",  tail,          ARGV) \
+        X("join",  join,          ARGV) \
+        X("eval",  eval,          ARGV) \
+        /* Mathematical functions */ \
+        X("+",     add,           ARGV) \
+        X("-",     sub,           ARGV) \
+        X("*",     mul,           ARGV) \
+        X("/",     div,           ARGV) \
+        X("%",     mod,           ARGV) \
+        X("^",     power,         ARGV) \
+        X("max",   max,           ARGV) \
+        X("min",   min,           ARGV) \
+        /* Comparasion functions */ \
+        X(">",     gt,            ARGV) \
+        X("<",     lt,            ARGV) \
+        X(">=",    ge,            ARGV) \
+        X("<=",    le,            ARGV) \
+        X("==",    eq,            ARGV) \
+        X("!=",    ne,            ARGV) \
+        /* Variable functions */ \
+        X("def",   def,           SEXPR) \
+        X("=",     put,           SEXPR) \
+        X("\\",    lambda,        SEXPR) \
+        X("fun",   fun,           SEXPR) \
+        /* System functions */ \
+        X("exit",  exit,          SEXPR) \
+        X("load",  load,          SEXPR) \
+        X("print", print,         SEXPR) \
+        X("error", error,         SEXPR) \
+        /* logical functions */ \
+        X("if",    if,            SEXPR) \
+        X("&&",    logical_and,   ARGV) \
+        X("||",    logical_or,    ARGV) \
+        X("!",     logical_not,   ARGV)
+
+#define BUILTIN_PROTOTYPE_ARGV(name) lval * builtin_##name(lenv * e, int argc, lval ** argv);
+#define BUILTIN_PROTOTYPE_SEXPR(name) lval * builtin_##name(lenv * e, lval * v);
+#define BUILTIN_DECLARE(sym, name, abi) BUILTIN_PROTOTYPE_##abi(name)
 
-lval * builtin_exit(lenv * e, lval * v);
+BUILTINS(BUILTIN_DECLARE)
 
-/* ordering functions */
+extern const lval builtin_values[];
+extern const int builtin_count;
 
-lval * builtin_gt(lenv * e, lval * v);
-lval * builtin_ge(lenv * e, lval * v);
-lval * builtin_lt(lenv * e, lval * v);
-lval * builtin_le(lenv * e, lval * v);
-lval * builtin_eq(lenv * e, lval * v);
-lval * builtin_ne(lenv * e, lval * v);
+/*
+ * Mathematical functions
+ *
+ * X(name, symbol, domain, unary, fold, reduce) defines builtin_<name>.
+ * With one argument 'unary' is applied to x, otherwise each following
+ * argument y is folded into x by 'fold'. Both update x in place and are
+ * true if the result doesn't fit in a long, which is an error rather
+ * than signed overflow. 'domain' is the error for a y the operator
+ * isn't defined for, or 0. Long argument lists are first tried on the
+ * lreduce.h kernel 'reduce'.
+ */
+#define BUILTIN_DIV_DOMAIN (y == 0 ? "Division By Zero!" : 0)
+#define BUILTIN_ARITH_OPS(X) \
+        X(add,   "+",   0, 0, __builtin_add_overflow(x, y, &x),             lreduce_sum) \
+        X(sub,   "-",   0, __builtin_sub_overflow(0, x, &x), \
+                              __builtin_sub_overflow(x, y, &x),             lreduce_none) \
+        X(mul,   "*",   0, 0, __builtin_mul_overflow(x, y, &x),             lreduce_product) \
+        X(div,   "/",   BUILTIN_DIV_DOMAIN, 0, \
+                              (y == -1 && x == LONG_MIN) || (x /= y, 0),    lreduce_none) \
+        X(mod,   "%",   BUILTIN_DIV_DOMAIN, 0, \
+                              (x = y == -1 ? 0 : x % y, 0),                 lreduce_none) \
+        X(power, "^",   (y < 0 ? "Negative Exponent!" : 0), 0, \
+                              builtin_power_overflow(&x, y),                lreduce_none) \
+        X(max,   "max", 0, 0, (x = x < y ? y : x, 0),                       lreduce_max) \
+        X(min,   "min", 0, 0, (x = x > y ? y : x, 0),                       lreduce_min)
 
-/* logical operators */
-lval * builtin_logical_and(lenv * e, lval * v);
-lval * builtin_logical_or(lenv * e, lval * v);
-lval * builtin_logical_not(lenv * e, lval * v);
+/* ordering functions, X(name, symbol, test) on two numbers x and y */
+#define BUILTIN_ORD_OPS(X) \
+        X(gt, ">",  x > y) \
+        X(lt, "<",  x < y) \
+        X(ge, ">=", x >= y) \
+        X(le, "<=", x <= y)
 
-/* operators */
-lval * builtin_if(lenv * e, lval * v);
-lval * builtin_load(lenv * e, lval * v);
-lval * builtin_print(lenv * e, lval * v);
-lval * builtin_error(lenv * e, lval * v);
+/* equality functions, X(name, symbol, test) on eq, whether lval_eq holds */
+#define BUILTIN_EQ_OPS(X) \
+        X(eq, "==", eq) \
+        X(ne, "!=", !eq)
+
+lval * builtin_var(lenv* e, lval * v, char* func);
 
 #endif
@@ -1,124 +1,513 @@
+#include <stdlib.h>
+
 #include "eval.h"
 #include "builtin.h"
+#include "lgc.h"
+#include "lsym.h"
+#include "vm.h"
 /* evaluation functions */
 
+size_t eval_stack_limit = EVAL_STACK_LIMIT;
+
+/*
+ * The evaluator runs on an explicit stack of frames on the heap rather
+ * than on the C stack, so Lispy recursion is only limited by
+ * eval_stack_limit, and running out of it is an ordinary error.
+ *
+ * A list frame evaluates the cells of an S-Expression one by one onto
+ * a value stack shared by all frames. A cell that is an S-Expression
+ * itself pushes a frame of its own, whose value is handed back to the
+ * frame below once done. The function is then called on the values in
+ * place, see lbuiltin_argv. Calling a lambda pushes a body frame owning
+ * the new environment. 'if' and 'eval' are run by the loop itself
+ * instead of recursing through their builtins.
+ *
+ * A list frame right above a body frame is in tail position: a lambda
+ * called from there replaces the body frame, dropping its environment
+ * unless a closure still holds on to it.
+ */
+
+typedef enum {
+        LFRAME_LIST,    /* evaluating the cells of 'v' */
+        LFRAME_IF,      /* waiting for the condition of an 'if' */
+        LFRAME_BODY     /* running a lambda body in 'env' */
+} lframe_kind;
+
+typedef struct {
+        lframe_kind kind;
+        int tail;       /* a list frame whose value is that of the body */
+        int i;          /* next cell of 'v', or the number of arguments of 'if' */
+        int base;       /* the frame's first value, its arguments so far */
+        lenv * env;
+        lval * v;       /* borrowed */
+        lval * hold;    /* keeps 'v' alive: a body, or the branch or argument of 'if' and 'eval' */
+        lval * owned;   /* the function, held while the arguments are evaluated */
+} lframe;
+
+typedef struct {
+        lframe * frames;
+        int count;
+        int capacity;
+
+        lval ** values;
+        int sp;
+        int values_capacity;
+} lstack;
+
+lval * lval_stack_overflow(void) {
+        return lval_err("Stack overflow. Evaluation needs more than %lu bytes.",
+                (unsigned long) eval_stack_limit);
+}
+
+/* make room for 'frames' frames and 'values' values, 0 if over the limit */
+static int lstack_reserve(lstack * s, int frames, int values) {
+        if (frames <= s->capacity && values <= s->values_capacity) return 1;
+
+        size_t fcap = s->capacity;
+        size_t vcap = s->values_capacity;
+
+        while (fcap < frames) fcap = fcap ? fcap * 2 : 16;
+        while (vcap < values) vcap = vcap ? vcap * 2 : 64;
+
+        if (fcap * sizeof(lframe) + vcap * sizeof(lval *) > eval_stack_limit) {
+                fcap = frames > s->capacity ? frames : s->capacity;
+                vcap = values > s->values_capacity ? values : s->values_capacity;
+
+                if (fcap * sizeof(lframe) + vcap * sizeof(lval *) > eval_stack_limit)
+                        return 0;
+        }
+
+        if (fcap != s->capacity) {
+                s->frames = realloc(s->frames, sizeof(lframe) * fcap);
+                s->capacity = fcap;
+        }
+
+        if (vcap != s->values_capacity) {
+                s->values = realloc(s->values, sizeof(lval *) * vcap);
+                s->values_capacity = vcap;
+        }
+
+        return 1;
+}
+
+/*
+ * a new frame on top with room for 'values' more values, or NULL if
+ * that would go over eval_stack_limit
+ */
+static lframe * lstack_push(lstack * s, lframe_kind kind, lenv * e, int values) {
+        if (!lstack_reserve(s, s->count + 1, s->sp + values)) return NULL;
+
+        lframe * f = &s->frames[s->count++];
+
+        f->kind = kind;
+        f->tail = 0;
+        f->i = 0;
+        f->base = s->sp;
+        f->env = e;
+        f->v = NULL;
+        f->hold = NULL;
+        f->owned = NULL;
+
+        return f;
+}
+
+/* evaluate 'v' and free it */
 lval * lval_eval(lenv * e, lval * v) {
-        if (v->type == LVAL_SYM) {
-                lval * x = lenv_get(e, v);
-                lval_del(v);
+        lval * result = vm_enabled ? vm_eval(e, v) : lval_eval_tree(e, v);
+        lval_del(v);
+        return result;
+}
+
+/* a symbol or a value that evaluates to itself */
+static lval * lval_eval_atom(lenv * e, lval * v) {
+        if (LTYPE(v) == LVAL_SYM)
+                return lenv_get(e, v);
+
+        return lval_copy(v);
+}
+
+/* evaluate 'v' without changing or freeing it */
+lval * lval_eval_tree(lenv * e, lval * v) {
+        if (LTYPE(v) == LVAL_SEXPR)
+                return lval_eval_list(e, v);
+
+        return lval_eval_atom(e, v);
+}
+
+/*
+ * Start evaluating the cells of 'v' as an S-Expression. Returns the
+ * value when that takes no frame, otherwise NULL with a list frame
+ * pushed. 'hold' is freed once 'v' is no longer needed.
+ */
+static lval * lval_enter(lstack * s, lenv * e, lval * v, int tail, lval * hold) {
+        while (v->count == 1 && LTYPE(v->cell[0]) == LVAL_SEXPR)
+                v = v->cell[0];
+
+        if (v->count < 2) {
+                lval * x = v->count == 0 ? lval_sexpr() : lval_eval_atom(e, v->cell[0]);
+                if (hold != NULL) lval_del(hold);
                 return x;
         }
 
-        if (v->type == LVAL_SEXPR)
-                return lval_eval_sexpr(e, v);
+        lframe * f = lstack_push(s, LFRAME_LIST, e, v->count - 1);
 
-        return v;
+        if (f == NULL) {
+                if (hold != NULL) lval_del(hold);
+                return lval_stack_overflow();
+        }
+
+        // a function called by name is looked up before its arguments run,
+        // and held on to, so they can't redefine or free it
+        if (LTYPE(v->cell[0]) == LVAL_SYM) {
+                f->owned = lenv_get(e, v->cell[0]);
+                f->i = 1;
+        }
+
+        f->tail = tail;
+        f->v = v;
+        f->hold = hold;
+
+        return NULL;
 }
 
-lval * lval_eval_sexpr(lenv * e, lval * v) {
-        for (int i = 0; i < v->count; i++)
-                v->cell[i] = lval_eval(e, v->cell[i]);
+/* store the value of cell i - 1 of a list frame */
+static void lframe_store(lstack * s, lframe * f, lval * x) {
+        if (f->i == 1)
+                f->owned = x;
+        else
+                s->values[s->sp++] = x;
+}
 
-        for (int i = 0; i < v->count; i++)
-                if (v->cell[i]->type == LVAL_ERR)
-                        return lval_take(v, i);
+/*
+ * the function to call once all cells are evaluated, or NULL with the
+ * first error in '*err' and the arguments freed
+ */
+static lval * lval_callee(lstack * s, lframe * f, lval ** err) {
+        lval * func = f->owned;
+        lval ** argv = &s->values[f->base];
+        int argc = s->sp - f->base;
 
-        if (v->count == 0) return v;
+        *err = NULL;
 
-        if (v->count == 1) return lval_take(v, 0);
+        if (LTYPE(func) == LVAL_ERR) {
+                *err = func;
+                f->owned = NULL;
+        }
 
-        lval * f = lval_pop(v, 0);
+        for (int i = 0; *err == NULL && i < argc; i++) {
+                if (LTYPE(argv[i]) == LVAL_ERR) {
+                        *err = argv[i];
+                        argv[i] = NULL;
+                }
+        }
 
-        if (f->type != LVAL_FUN) {
-                lval * err = lval_err(
+        if (*err == NULL && LTYPE(func) != LVAL_FUN) {
+                *err = lval_err(
                         "S-Expression starts with incorrect type. Got %s, Expected %s.",
-                        ltype_name(f->type),
+                        ltype_name(LTYPE(func)),
                         ltype_name(LVAL_FUN)
                 );
-                lval_del(f);
-                lval_del(v);
+        }
+
+        if (*err == NULL) return func;
+
+        for (int i = 0; i < argc; i++)
+                if (argv[i] != NULL) lval_del(argv[i]);
+
+        if (f->owned != NULL) lval_del(f->owned);
+        f->owned = NULL;
+        s->sp = f->base;
+
+        return NULL;
+}
+
+lval * lval_call_builtin(lenv * e, lval * func, int argc, lval ** argv) {
+        if (func->flags & LVAL_F_ARGV)
+                return func->builtin_argv(e, argc, argv);
+
+        lval * args = lval_reserve(lval_sexpr(), argc);
+
+        for (int i = 0; i < argc; i++)
+                lval_add(args, argv[i]);
+
+        return func->builtin(e, args);
+}
+
+/*
+ * Call 'func' on the values from 'base' up, both taken over ('owned'
+ * is freed when done, if not NULL). Returns the value, or NULL when
+ * frames were pushed.
+ */
+static lval * lval_apply(lstack * s, lenv * e, lval * func, lval * owned, int base, int tail) {
+        int argc = s->sp - base;
+        lval * x;
+
+        if (LVAL_IS_BUILTIN(func)) {
+                lval ** argv = &s->values[base];
+
+                if (func->builtin == builtin_if &&
+                        (argc == 2 || argc == 3) &&
+                        LTYPE(argv[0]) == LVAL_QEXPR &&
+                        LTYPE(argv[1]) == LVAL_QEXPR &&
+                        (argc == 2 || LTYPE(argv[2]) == LVAL_QEXPR)) {
+                        if (owned != NULL) lval_del(owned);
+
+                        // the branches stay on the stack until the condition is known
+                        lframe * f = lstack_push(s, LFRAME_IF, e, 0);
+
+                        if (f == NULL) {
+                                lval_del_argv(argc, &s->values[base]);
+                                s->sp = base;
+                                return lval_stack_overflow();
+                        }
+
+                        f->tail = tail;
+                        f->i = argc;
+                        f->base = base;
+
+                        return lval_enter(s, e, s->values[base], 0, NULL);
+                }
+
+                s->sp = base;
+
+                if (func->builtin_argv == builtin_eval &&
+                        argc == 1 && LTYPE(argv[0]) == LVAL_QEXPR) {
+                        if (owned != NULL) lval_del(owned);
+                        return lval_enter(s, e, argv[0], tail, argv[0]);
+                }
+
+                x = lval_call_builtin(e, func, argc, argv);
+                if (owned != NULL) lval_del(owned);
+                return x;
+        }
+
+        s->sp = base;
+
+        if (vm_enabled) {
+                x = vm_call(e, func, argc, &s->values[base]);
+                if (owned != NULL) lval_del(owned);
+                return x;
+        }
+
+        lenv * env;
+
+        x = lval_bind(func, argc, &s->values[base], &env);
+
+        if (x != NULL) {
+                if (owned != NULL) lval_del(owned);
+                return x;
+        }
+
+        // hold on to the body in case the call redefines 'func'
+        lval * body = lval_copy(func->body);
+        lframe * f = s->count > 0 ? &s->frames[s->count - 1] : NULL;
+
+        if (tail && f != NULL && f->kind == LFRAME_BODY) {
+                lenv_del(f->env);
+                lval_del(f->hold);
+        } else {
+                f = lstack_push(s, LFRAME_BODY, e, 0);
+
+                if (f == NULL) {
+                        if (owned != NULL) lval_del(owned);
+                        lenv_del(env);
+                        lval_del(body);
+                        return lval_stack_overflow();
+                }
+        }
+
+        if (owned != NULL) lval_del(owned);
+
+        f->env = env;
+        f->hold = body;
+
+        return lval_enter(s, env, body, 1, NULL);
+}
+
+/* continue a list frame, given the value of its last cell (or NULL) */
+static lval * lval_step_list(lstack * s, lval * x) {
+        lframe * f = &s->frames[s->count - 1];
+
+        if (x != NULL) lframe_store(s, f, x);
+
+        while (f->i < f->v->count) {
+                lval * cell = f->v->cell[f->i++];
+
+                if (LTYPE(cell) == LVAL_SEXPR) {
+                        x = lval_enter(s, f->env, cell, 0, NULL);
+
+                        if (x == NULL) return NULL;
+
+                        f = &s->frames[s->count - 1];
+                } else {
+                        x = lval_eval_atom(f->env, cell);
+                }
+
+                lframe_store(s, f, x);
+        }
+
+        lval * err;
+        lval * func = lval_callee(s, f, &err);
+
+        // the frame goes, its environment, function and arguments stay alive
+        lframe done = *f;
+        s->count--;
+
+        if (func == NULL) {
+                if (done.hold != NULL) lval_del(done.hold);
                 return err;
         }
 
-        lval * result = lval_call(e, f, v);
-        lval_del(f);
-        return result;
+        x = lval_apply(s, done.env, func, done.owned, done.base, done.tail);
+
+        if (done.hold != NULL) lval_del(done.hold);
+        return x;
+}
+
+/* pick the branch of an 'if' frame given its condition */
+static lval * lval_step_if(lstack * s, lval * cond) {
+        lframe done = s->frames[--s->count];
+        lval ** argv = &s->values[done.base];
+
+        s->sp = done.base;
+
+        if (LTYPE(cond) == LVAL_ERR) {
+                lval_del_argv(done.i, argv);
+                return cond;
+        }
+
+        int b;
+
+        // treat not number like TRUE
+        if (LTYPE(cond) != LVAL_NUM) b = 1;
+        else if (LNUM(cond) != 0) b = 1;
+        else if (done.i == 3) b = 2;
+        else b = -1;
+
+        lval_del(cond);
+
+        for (int i = 0; i < done.i; i++)
+                if (i != b) lval_del(argv[i]);
+
+        if (b == -1) return lval_sexpr();
+
+        return lval_enter(s, done.env, argv[b], done.tail, argv[b]);
+}
+
+static lval * lval_step_body(lstack * s, lval * x) {
+        lframe done = s->frames[--s->count];
+
+        lenv_del(done.env);
+        lval_del(done.hold);
+
+        return x;
+}
+
+/* run until every frame is done, starting by handing 'x' to the top one */
+static lval * lval_run(lstack * s, lval * x) {
+        while (s->count > 0) {
+                switch (s->frames[s->count - 1].kind) {
+                        case LFRAME_LIST: x = lval_step_list(s, x); break;
+                        case LFRAME_IF: x = lval_step_if(s, x); break;
+                        case LFRAME_BODY: x = lval_step_body(s, x); break;
+                }
+        }
+
+        free(s->frames);
+        free(s->values);
+        return x;
+}
+
+/* evaluate the cells of 'v' as an S-Expression, leaving 'v' untouched */
+lval * lval_eval_list(lenv * e, lval * v) {
+        lstack s = {0};
+        return lval_run(&s, lval_enter(&s, e, v, 0, NULL));
+}
+
+/* call 'func' without changing it; the values in 'argv' are taken over */
+lval * lval_call(lenv * e, lval * func, int argc, lval ** argv) {
+        lstack s = {0};
+
+        if (!lstack_reserve(&s, 0, argc)) {
+                lval_del_argv(argc, argv);
+                return lval_stack_overflow();
+        }
+
+        for (int i = 0; i < argc; i++)
+                s.values[s.sp++] = argv[i];
+
+        return lval_run(&s, lval_apply(&s, e, func, NULL, 0, 0));
 }
 
-lval *lval_call(lenv * e, lval * func, lval * args) {
-        if (func->builtin) return func->builtin(e, args);
+lval * lval_bind(lval * func, int argc, lval ** argv, lenv ** env) {
+        lval * formals = func->formals;
 
-        int given = args->count;
-        int total = func->formals->count;
+        // every reference is counted here, as the collector needs
+        lgc_poll();
+        lval_free_step();
 
-        while (args->count > 0) {
-                if (func->formals->count == 0) {
-                        lval_del(args);
+        *env = lenv_copy(func->env);
+
+        int total = formals->count;
+        int i = 0;
+
+        // arguments go into the entries in formals order, the function stays as it is
+        lenv_reserve(*env, (*env)->count + (argc < total ? argc : total));
+
+        for (int j = 0; j < argc; j++) {
+                if (i == formals->count) {
+                        lenv_del(*env);
+                        lval_del_argv(argc - j, argv + j);
                         return lval_err(
                                 "Function passed too many arguments. Got %d, Expected %d.",
-                                given,
+                                argc,
                                 total
                         );
                 }
 
-                lval * sym = lval_pop(func->formals, 0);
+                lval * sym = formals->cell[i++];
 
-                if (strcmp(sym->sym, "&") == 0) {
-                        if (func->formals->count != 1) {
-                                lval_del(args);
+                if (sym->sym == lsym_rest) {
+                        if (formals->count - i != 1) {
+                                lenv_del(*env);
+                                lval_del_argv(argc - j, argv + j);
                                 return lval_err(
                                         "Function format invalid. "
                                         "Symbol '&' not followed by single symbol."
                                 );
                         }
 
-                        lval * nsym = lval_pop(func->formals, 0);
-                        lenv_put(func->env, nsym, builtin_list(e, args));
-                        lval_del(sym);
-                        lval_del(nsym);
+                        // the rest of the arguments, sliced off argv
+                        lenv_bind(*env, formals->cell[i++]->sym, builtin_list(NULL, argc - j, argv + j));
                         break;
                 }
 
-                lval * val = lval_pop(args, 0);
-
-                lenv_put(func->env, sym, val);
-
-                lval_del(sym);
-
-                lval_del(val);
+                lenv_bind(*env, sym->sym, argv[j]);
         }
 
-        lval_del(args);
-
-        if (func->formals->count > 0 && strcmp(func->formals->cell[0]->sym, "&") == 0) {
-                if (func->formals->count != 2) {
+        if (i < formals->count && formals->cell[i]->sym == lsym_rest) {
+                if (formals->count - i != 2) {
+                        lenv_del(*env);
                         return lval_err(
                                 "Function format invalid. "
                                 "Symbol '&' not followed by single symbol."
                         );
                 }
 
-                lval_del(lval_pop(func->formals, 0));
+                lenv_bind(*env, formals->cell[i + 1]->sym, lval_qexpr());
+                i += 2;
+        }
 
-                lval * sym = lval_pop(func->formals, 0);
-                lval * value = lval_qexpr();
+        (*env)->fixed = (*env)->count;
 
-                lenv_put(func->env, sym, value);
-                lval_del(sym);
-                lval_del(value);
-        }
+        if (i == formals->count) return NULL;
 
-        if (func->formals->count == 0) {
-                func->env->parent = e;
-                return builtin_eval(
-                        func->env,
-                        lval_add(
-                                lval_sexpr(),
-                                lval_copy(func->body)
-                        )
-                );
+        // partially applied: a new function over the remaining formals
+        lval * partial = lval_lambda(formals, func->body);
 
-        } else {
-                return lval_copy(func);
-        }
+        partial->formals = lval_slice(partial->formals, i, formals->count - i);
+        lenv_del(partial->env);
+        partial->env = *env;
+
+        return partial;
 }
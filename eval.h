@@ -4,10 +4,40 @@
 #include "lval.h"
 #include "lenv.h"
 
+#include <stddef.h>
+
 /* evaluation functions */
 
+/* default for eval_stack_limit, in bytes */
+#define EVAL_STACK_LIMIT ((size_t) 64 << 20)
+
+/*
+ * most memory the frames of one evaluation may take; deeper recursion
+ * is an error (--stack-limit)
+ */
+extern size_t eval_stack_limit;
+
+/* the error for going over eval_stack_limit */
+lval * lval_stack_overflow(void);
+
 lval * lval_eval(lenv * e, lval * v);
-lval * lval_eval_sexpr(lenv * e, lval * v);
-lval *lval_call(lenv * e, lval * func, lval * args);
+lval * lval_eval_tree(lenv * e, lval * v);
+lval * lval_eval_list(lenv * e, lval * v);
+lval * lval_call(lenv * e, lval * func, int argc, lval ** argv);
+
+/*
+ * call builtin 'func' on 'argv', the values taken over but not the
+ * array; builtins still on the S-Expression ABI get them as a list
+ */
+lval * lval_call_builtin(lenv * e, lval * func, int argc, lval ** argv);
+
+/*
+ * bind 'argv' to the formals of lambda 'func' in a copy of its
+ * environment, a child of the one 'func' was created in. Returns NULL
+ * and sets '*env' once every formal is bound, otherwise an error or
+ * the partially applied function. The values in 'argv' are taken
+ * over, the array is not.
+ */
+lval * lval_bind(lval * func, int argc, lval ** argv, lenv ** env);
 
 #endif
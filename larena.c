@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "larena.h"
+#include "lfree.h"
+#include "lgc.h"
+#include "lval.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+/* blocks that aren't handed out are poisoned, so ASan still sees use after free */
+#define LARENA_POISON(p, size) ASAN_POISON_MEMORY_REGION(p, size)
+#define LARENA_UNPOISON(p, size) ASAN_UNPOISON_MEMORY_REGION(p, size)
+#else
+#define LARENA_POISON(p, size) ((void) (p), (void) (size))
+#define LARENA_UNPOISON(p, size) ((void) (p), (void) (size))
+#endif
+
+#define LARENA_CHUNK_BYTES 65536
+/* larger blocks are malloc'd */
+#define LARENA_MAX_BLOCK 1024
+
+int larena_enabled = 0;
+
+typedef struct {
+        char * base;
+        size_t used;
+        /* blocks handed out and not given back yet */
+        int live;
+} larena_chunk;
+
+static struct {
+        larena_chunk * chunks;
+        int count;
+        int capacity;
+        /* chunks nothing is used in, other than the current ones */
+        int * spare;
+        int spares;
+        /* index of the chunk blocks of each kind are carved from, -1 if none */
+        int current[LARENA_KINDS];
+        /* forms being evaluated */
+        int depth;
+        /* blocks handed out and not given back, in all chunks */
+        long live;
+} arena = {.current = {-1, -1}};
+
+static struct {
+        unsigned long forms;
+        unsigned long blocks;
+        /* chunks emptied while a form ran */
+        unsigned long resets;
+        /* forms that left cycles to collect */
+        unsigned long collections;
+        /* chunks still in use when a form ended */
+        unsigned long kept;
+} totals;
+
+void larena_begin(void) {
+        if (larena_enabled) arena.depth++;
+}
+
+void larena_end(void) {
+        if (!larena_enabled || --arena.depth > 0) return;
+
+        // what the form left to be freed later goes now
+        lval_free_flush();
+
+        /*
+         * What outlives the form is out of the arena (lval_evacuate), so
+         * what is left are cycles of garbage: mostly young, but an
+         * earlier collection in the form may have made them old.
+         */
+        if (arena.live > 0) totals.collections++;
+
+        for (int full = 0; full <= 1 && arena.live > 0; full++) {
+                lgc_collect(full);
+                lval_free_flush();
+        }
+
+        /*
+         * Should anything still be in use, say held by a value that was
+         * never moved out, its chunk is kept until that is given back
+         * (larena_free). The others are reset.
+         */
+        totals.forms++;
+        arena.spares = 0;
+
+        for (int k = 0; k < arena.count; k++) {
+                if (arena.chunks[k].live > 0) {
+                        totals.kept++;
+                        continue;
+                }
+
+                LARENA_POISON(arena.chunks[k].base, arena.chunks[k].used);
+                arena.chunks[k].used = 0;
+                arena.spare[arena.spares++] = k;
+        }
+
+        for (int kind = 0; kind < LARENA_KINDS; kind++)
+                arena.current[kind] = -1;
+}
+
+/* make an empty chunk current for 'kind' */
+static void larena_next(larena_kind kind) {
+        int k;
+
+        if (arena.spares > 0) {
+                k = arena.spare[--arena.spares];
+        } else {
+                if (arena.count == arena.capacity) {
+                        arena.capacity = arena.capacity ? arena.capacity * 2 : 16;
+                        arena.chunks = realloc(arena.chunks, sizeof(larena_chunk) * arena.capacity);
+                        arena.spare = realloc(arena.spare, sizeof(int) * arena.capacity);
+                }
+
+                k = arena.count++;
+                arena.chunks[k].base = malloc(LARENA_CHUNK_BYTES);
+                arena.chunks[k].used = 0;
+                arena.chunks[k].live = 0;
+
+                LARENA_POISON(arena.chunks[k].base, LARENA_CHUNK_BYTES);
+        }
+
+        // the chunk it replaces goes spare once everything in it is given back
+        arena.current[kind] = k;
+}
+
+void * larena_alloc(larena_kind kind, size_t size, int * chunk) {
+        if (arena.depth == 0 || size > LARENA_MAX_BLOCK) {
+                *chunk = 0;
+                return malloc(size);
+        }
+
+        if (arena.current[kind] == -1 ||
+                arena.chunks[arena.current[kind]].used + size > LARENA_CHUNK_BYTES)
+                larena_next(kind);
+
+        larena_chunk * c = &arena.chunks[arena.current[kind]];
+        void * p = c->base + c->used;
+
+        c->used += size;
+        c->live++;
+        arena.live++;
+        totals.blocks++;
+
+        LARENA_UNPOISON(p, size);
+
+        *chunk = arena.current[kind] + 1;
+        return p;
+}
+
+void * larena_realloc(larena_kind kind, void * p, size_t old_size, size_t size, int * chunk) {
+        if (p == NULL) return larena_alloc(kind, size, chunk);
+        if (*chunk == 0) return realloc(p, size);
+
+        int from = *chunk;
+        void * q = larena_alloc(kind, size, chunk);
+
+        memcpy(q, p, old_size < size ? old_size : size);
+        larena_free(p, old_size, from);
+
+        return q;
+}
+
+void * larena_move(void * p, size_t size, int * chunk) {
+        if (*chunk == 0) return p;
+
+        void * q = malloc(size);
+
+        memcpy(q, p, size);
+        larena_free(p, size, *chunk);
+        *chunk = 0;
+
+        return q;
+}
+
+void larena_free(void * p, size_t size, int chunk) {
+        if (chunk == 0) {
+                lfree(p, size);
+                return;
+        }
+
+        int k = chunk - 1;
+        larena_chunk * c = &arena.chunks[k];
+
+        LARENA_POISON(p, size);
+
+        int current = 0;
+
+        for (int kind = 0; kind < LARENA_KINDS; kind++)
+                current |= k == arena.current[kind];
+
+        // the last block carved is carved again, which suits call environments
+        if (current && (char *) p + size == c->base + c->used)
+                c->used -= size;
+
+        arena.live--;
+
+        if (--c->live > 0) return;
+
+        c->used = 0;
+        totals.resets++;
+
+        if (!current) arena.spare[arena.spares++] = k;
+}
+
+void larena_print_stats(void) {
+        fprintf(stderr,
+                "arena: %lu forms, %lu blocks, %d chunks, %lu chunks emptied within a form, "
+                "%lu forms left cycles to collect, %lu chunks kept past a form\n",
+                totals.forms, totals.blocks, arena.count, totals.resets, totals.collections,
+                totals.kept);
+}
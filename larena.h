@@ -0,0 +1,67 @@
+#ifndef LARENA_H
+#define LARENA_H
+
+#include <stddef.h>
+
+/*
+ * Per-form arena (--arena).
+ *
+ * builtin_load and the REPL evaluate one top-level form at a time, and
+ * most of the lists and call environments made while doing so are
+ * garbage once it is done. In arena mode their memory (cell storage,
+ * see lval.h, and the tables of environments) is bump-allocated from
+ * 64 KiB chunks while a form runs, instead of malloc'd, and every chunk
+ * is reset when the form ends. Giving a block back calls no free(): it
+ * only counts down the blocks used in its chunk, and a chunk whose
+ * count reaches zero is reused before the form ends.
+ *
+ * Whatever outlives the form is moved out of the arena as soon as it
+ * is stored where it will: in the global environment, or in anything
+ * already moved out, such as the environment a kept closure closes
+ * over (lval_evacuate). Environment structs are malloc'd, since they
+ * can't be moved while several closures point to them. So all that can
+ * be left in the arena when a form ends are cycles of garbage, which a
+ * collection (see lgc.h) breaks before the reset. A chunk that still
+ * has blocks in use after that isn't reset, but kept until they are
+ * given back.
+ */
+
+extern int larena_enabled;
+
+/*
+ * Lists and environment tables are carved from chunks of their own:
+ * call environments mostly go in the order they came, and mixing the
+ * two would leave fewer chunks to reuse within a form.
+ */
+typedef enum {
+        LARENA_CELLS,
+        LARENA_ENVS,
+        LARENA_KINDS
+} larena_kind;
+
+/*
+ * around each top-level form; a form may load a file of more. The
+ * arena is reset at the end of the outermost one.
+ */
+void larena_begin(void);
+void larena_end(void);
+
+/*
+ * 'size' bytes of 'kind', from the arena while a form runs and they
+ * are few enough, from malloc otherwise. '*chunk' is set to the number of the
+ * arena chunk, 0 for malloc'd memory; it is needed to give them back.
+ */
+void * larena_alloc(larena_kind kind, size_t size, int * chunk);
+
+/* malloc'd blocks are realloc'd, arena ones copied to a new block */
+void * larena_realloc(larena_kind kind, void * p, size_t old_size, size_t size, int * chunk);
+
+/* a malloc'd copy of a block of 'chunk', which is given back; 'p' if malloc'd */
+void * larena_move(void * p, size_t size, int * chunk);
+
+/* give back a block of 'chunk'; malloc'd ones go to lfree */
+void larena_free(void * p, size_t size, int chunk);
+
+void larena_print_stats(void);
+
+#endif
@@ -1,7 +1,13 @@
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+#include "larena.h"
 #include "lenv.h"
+#include "lgc.h"
+#include "lsym.h"
 
+#define LENV_MIN_INDEX 8
 
 /* lenv CONSTRUCOR */
 
@@ -9,9 +15,21 @@ lenv * lenv_new(void) {
         lenv * v = malloc(sizeof(lenv));
 
         v->parent = NULL;
+        v->refs = 1;
+        v->scope = 0;
+        v->fixed = 0;
         v->count = 0;
-        v->syms = NULL;
-        v->vals = NULL;
+        v->capacity = 0;
+        v->entries = NULL;
+        v->index_size = 0;
+        v->indexed = 0;
+        v->index = NULL;
+        v->gc = 0;
+        v->kept = 0;
+        v->entries_arena = 0;
+        v->index_arena = 0;
+
+        lgc_track(v);
 
         return v;
 }
@@ -19,48 +37,217 @@ lenv * lenv_new(void) {
 /* lenv DESTRUCTOR */
 
 void lenv_del(lenv * e) {
-        for (int i = 0; i < e->count; i++) {
-                free(e->syms[i]);
-                lval_del(e->vals[i]);
+        lenv_del_into(e, lval_del);
+}
+
+void lenv_del_into(lenv * e, void (*drop)(lval *)) {
+        // up the parents as long as the last reference to them goes too
+        while (e != NULL && --e->refs == 0) {
+                lenv * parent = e->parent;
+
+                for (int i = 0; i < e->count; i++)
+                        drop(e->entries[i].val);
+
+                lgc_untrack(e);
+
+                larena_free(e->entries, sizeof(lenv_entry) * e->capacity, e->entries_arena);
+                larena_free(e->index, sizeof(int) * e->index_size, e->index_arena);
+                free(e);
+
+                // roots aren't counted, see lenv_retain
+                e = parent != NULL && parent->parent != NULL ? parent : NULL;
+        }
+}
+
+/* roots outlive everything run in them, so references to them aren't counted */
+lenv * lenv_retain(lenv * e) {
+        if (e->parent != NULL) e->refs++;
+        return e;
+}
+
+void lenv_release(lenv * e) {
+        if (e->parent != NULL) lenv_del(e);
+}
+
+/* roots and kept environments outlive the form, see larena.h */
+static int lenv_kept(lenv * e) {
+        return e->parent == NULL || e->kept;
+}
+
+/* resize a table of 'e', from the arena unless 'e' is kept */
+static void * lenv_table(lenv * e, void * p, size_t old_size, size_t size, int * chunk) {
+        if (lenv_kept(e)) return realloc(p, size);
+
+        return larena_realloc(LARENA_ENVS, p, old_size, size, chunk);
+}
+
+/* hash table */
+
+static void lenv_index_insert(lenv * e, int n) {
+        unsigned long mask = e->index_size - 1;
+        unsigned long i = LSYM_HASH(e->entries[n].sym) & mask;
+
+        // a later binding of the same name (a repeated formal) wins
+        while (e->index[i] != -1 && e->entries[e->index[i]].sym != e->entries[n].sym)
+                i = (i + 1) & mask;
+
+        e->index[i] = n;
+}
+
+/* index the entries added since the last time, keeping it at most half full */
+static void lenv_index(lenv * e) {
+        if (e->count * 2 > e->index_size) {
+                int size = e->index_size ? e->index_size : LENV_MIN_INDEX;
+
+                while (e->count * 2 > size) size *= 2;
+
+                e->index = lenv_table(e, e->index, sizeof(int) * e->index_size,
+                        sizeof(int) * size, &e->index_arena);
+                e->index_size = size;
+                e->indexed = 0;
+
+                for (int i = 0; i < size; i++) e->index[i] = -1;
         }
 
-        free(e->syms);
-        free(e->vals);
-        free(e);
+        for (; e->indexed < e->count; e->indexed++)
+                lenv_index_insert(e, e->indexed);
+}
+
+/* position of interned 'sym' in e->entries, or -1 */
+static int lenv_find(lenv * e, char * sym, unsigned long hash) {
+        if (e->count == 0) return -1;
+        if (e->indexed < e->count) lenv_index(e);
+
+        unsigned long mask = e->index_size - 1;
+
+        for (unsigned long i = hash & mask; ; i = (i + 1) & mask) {
+                int n = e->index[i];
+
+                if (n == -1) return -1;
+                if (e->entries[n].sym == sym) return n;
+        }
+}
+
+void lenv_reserve(lenv * e, int capacity) {
+        if (capacity <= e->capacity) return;
+
+        int old = e->capacity;
+
+        e->capacity = e->capacity ? e->capacity : LENV_MIN_INDEX / 2;
+        while (e->capacity < capacity) e->capacity *= 2;
+
+        e->entries = lenv_table(e, e->entries, sizeof(lenv_entry) * old,
+                sizeof(lenv_entry) * e->capacity, &e->entries_arena);
 }
 
 /* lenv interface */
 
+/*
+ * Bumped whenever the value of a global changes, which invalidates
+ * every symbol's cached global. Stops at UINT_MAX, after which nothing
+ * is cached any more.
+ */
+static unsigned int lenv_version = 1;
+
+static struct {
+        unsigned long hits;
+        unsigned long misses;
+} lenv_cache;
+
+/*
+ * the binding 'name' was resolved to by lenv_capture, or NULL if it
+ * may not be the one a search by name would find
+ */
+static lval * lenv_lookup_resolved(lenv * e, lval * name) {
+        if (e->scope != name->scope) return NULL;
+
+        if (name->flags & LVAL_F_GLOBAL) {
+                // a binding added by '=' on the way could hide the global
+                for (; e->parent != NULL; e = e->parent)
+                        if (e->count != e->fixed) return NULL;
+
+                if (name->stamp == lenv_version) {
+                        lenv_cache.hits++;
+                        return name->cached;
+                }
+
+                lenv_cache.misses++;
+
+                int n = lenv_find(e, name->sym, LSYM_HASH(name->sym));
+                if (n == -1) return NULL;
+
+                if (lenv_version != UINT_MAX) {
+                        name->cached = e->entries[n].val;
+                        name->stamp = lenv_version;
+                }
+
+                return e->entries[n].val;
+        }
+
+        for (int d = name->depth; d != 0 && e->parent != NULL; d--) {
+                if (e->count != e->fixed) return NULL;
+                e = e->parent;
+        }
+
+        int n = name->slot;
+
+        if (n < 0 || n >= e->count || e->entries[n].sym != name->sym) return NULL;
+
+        return e->entries[n].val;
+}
+
+lval * lenv_lookup(lenv * e, lval * name) {
+        if (name->scope != 0) {
+                lval * x = lenv_lookup_resolved(e, name);
+                if (x != NULL) return x;
+        }
+
+        unsigned long hash = LSYM_HASH(name->sym);
+
+        for (; e != NULL; e = e->parent) {
+                int n = lenv_find(e, name->sym, hash);
+
+                if (n != -1)
+                        return e->entries[n].val;
+        }
+
+        return NULL;
+}
+
 lval * lenv_get(lenv * e, lval * name) {
-        for (int i = 0; i < e->count; i++)
-                if (strcmp(e->syms[i], name->sym) == 0)
-                        return lval_copy(e->vals[i]);
+        lval * x = lenv_lookup(e, name);
 
-        if (e->parent)
-                return lenv_get(e->parent, name);
+        if (x != NULL)
+                return lval_copy(x);
         else
                 return lval_err("Undound Symbol '%s'", name->sym);
 }
 
 /* define variable locally */
 void lenv_put(lenv * e, lval * name, lval * value) {
-        for (int i = 0; i < e->count; i++) {
-                if (strcmp(e->syms[i], name->sym) == 0) {
-                        lval_del(e->vals[i]);
-                        e->vals[i] = lval_copy(value);
-                        return;
-                }
+        int n = lenv_find(e, name->sym, LSYM_HASH(name->sym));
+
+        if (n != -1) {
+                if (lenv_kept(e)) lval_evacuate(value);
+
+                lval_del(e->entries[n].val);
+                e->entries[n].val = lval_copy(value);
+
+                if (e->parent == NULL && lenv_version != UINT_MAX) lenv_version++;
+                return;
         }
 
-        e->count++;
+        lenv_bind(e, name->sym, lval_copy(value));
+}
 
-        e->syms = realloc(e->syms, sizeof(char*) * e->count);
-        e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+void lenv_bind(lenv * e, char * sym, lval * value) {
+        if (lenv_kept(e)) lval_evacuate(value);
 
-        e->syms[e->count - 1] = malloc(strlen(name->sym) + 1);
-        strcpy(e->syms[e->count - 1], name->sym);
+        lenv_reserve(e, e->count + 1);
 
-        e->vals[e->count - 1] = lval_copy(value);
+        e->entries[e->count].sym = sym;
+        e->entries[e->count].val = value;
+        e->count++;
 }
 
 /* define variable globally */
@@ -70,17 +257,176 @@ void lenv_def(lenv * e, lval * name, lval * value) {
 }
 
 lenv * lenv_copy(lenv * e) {
-        lenv * copy = malloc(sizeof(lenv));
-        copy->parent = e->parent;
-        copy->count = e->count;
-        copy->syms = malloc(sizeof(char*) * copy->count);
-        copy->vals = malloc(sizeof(lval*) * copy->count);
+        lenv * copy = lenv_new();
+        copy->parent = e->parent != NULL ? lenv_retain(e->parent) : NULL;
+        copy->scope = e->scope;
+        copy->fixed = e->fixed;
+
+        if (e->count == 0) return copy;
+
+        // the index is only built once the copy is searched by name
+        lenv_reserve(copy, e->count);
 
         for (int i = 0; i < e->count; i++) {
-                copy->syms[i] = malloc(strlen(e->syms[i]) + 1);
-                strcpy(copy->syms[i], e->syms[i]);
-                copy->vals[i] = lval_copy(e->vals[i]);
+                copy->entries[i].sym = e->entries[i].sym;
+                copy->entries[i].val = lval_copy(e->entries[i].val);
         }
 
+        copy->count = e->count;
+
         return copy;
 }
+
+void lenv_evacuate(lenv * e) {
+        e->entries = larena_move(e->entries, sizeof(lenv_entry) * e->capacity, &e->entries_arena);
+        e->index = larena_move(e->index, sizeof(int) * e->index_size, &e->index_arena);
+        e->kept = 1;
+}
+
+void lenv_clear(lenv * e) {
+        int count = e->count;
+
+        // the values may hold 'e' itself
+        e->count = 0;
+        e->fixed = 0;
+        e->indexed = 0;
+
+        for (int i = 0; i < e->index_size; i++) e->index[i] = -1;
+        for (int i = 0; i < count; i++) lval_del(e->entries[i].val);
+
+        if (e->parent == NULL && lenv_version != UINT_MAX) lenv_version++;
+}
+
+void lenv_traverse(lenv * e, lgc_visit visit, void * ctx) {
+        if (e->parent != NULL) visit(e->parent, LGC_ENV, ctx);
+
+        for (int i = 0; i < e->count; i++)
+                visit(e->entries[i].val, LGC_LVAL, ctx);
+}
+
+/* lexical addressing */
+
+/* lambda bodies resolved so far; like lenv_version, stops at UINT_MAX */
+static unsigned int lenv_scopes = 0;
+
+/* position of 'sym' among the bindings of 'formals' (the last one if repeated), or -1 */
+static int lenv_formal(lval * formals, lval * sym) {
+        int found = -1;
+        int slot = 0;
+
+        for (int i = 0; i < formals->count; i++) {
+                if (formals->cell[i]->sym == lsym_rest) continue;
+                if (formals->cell[i]->sym == sym->sym) found = slot;
+                slot++;
+        }
+
+        return found;
+}
+
+/* lists being resolved, in pairs of a list and its copy still to fill */
+static struct {
+        lval ** items;
+        int count;
+        int capacity;
+} resolving;
+
+static void resolving_push(lval * v, lval * x) {
+        if (resolving.count + 2 > resolving.capacity) {
+                resolving.capacity = resolving.capacity ? resolving.capacity * 2 : 64;
+                resolving.items = realloc(resolving.items, sizeof(lval *) * resolving.capacity);
+        }
+
+        resolving.items[resolving.count++] = v;
+        resolving.items[resolving.count++] = x;
+}
+
+/* an empty list of the type of 'v', with room for its cells */
+static lval * lenv_resolve_list(lval * v) {
+        return lval_reserve(LTYPE(v) == LVAL_SEXPR ? lval_sexpr() : lval_qexpr(), v->count);
+}
+
+/* see lenv_resolve; 'v' is not a list */
+static lval * lenv_resolve_atom(lenv * e, lval * formals, lval * v, unsigned int scope) {
+        if (LTYPE(v) != LVAL_SYM) return lval_copy(v);
+
+        lval * x = lval_own(lval_copy(v));
+        lenv * env = e;
+
+        x->scope = scope;
+        x->stamp = 0;
+        x->flags &= ~LVAL_F_GLOBAL;
+        x->depth = 0;
+        x->slot = lenv_formal(formals, x);
+
+        for (; x->slot == -1; env = env->parent) {
+                if (env->parent == NULL) {
+                        x->flags |= LVAL_F_GLOBAL;
+                        x->cached = NULL;
+                        break;
+                }
+
+                x->depth++;
+                x->slot = lenv_find(env, x->sym, LSYM_HASH(x->sym));
+        }
+
+        return x;
+}
+
+/*
+ * A copy of 'v' whose symbols say where they are bound for a body of
+ * 'formals' called in a child of 'e': depth 0 for the formals, the
+ * number of environments up for the bindings of enclosing calls, and
+ * LVAL_F_GLOBAL for everything else. Code and data can't be told apart
+ * here, so every symbol is resolved; it is only a hint, which
+ * lenv_lookup checks before use.
+ */
+static lval * lenv_resolve(lenv * e, lval * formals, lval * v, unsigned int scope) {
+        if (LTYPE(v) != LVAL_SEXPR && LTYPE(v) != LVAL_QEXPR)
+                return lenv_resolve_atom(e, formals, v, scope);
+
+        lval * copy = lenv_resolve_list(v);
+
+        // nested lists are added empty and filled once they come off the stack
+        resolving_push(v, copy);
+
+        while (resolving.count > 0) {
+                lval * x = resolving.items[--resolving.count];
+
+                v = resolving.items[--resolving.count];
+
+                for (int i = 0; i < v->count; i++) {
+                        lval * cell = v->cell[i];
+
+                        if (LTYPE(cell) == LVAL_SEXPR || LTYPE(cell) == LVAL_QEXPR) {
+                                lval * y = lenv_resolve_list(cell);
+
+                                lval_add(x, y);
+                                resolving_push(cell, y);
+                        } else {
+                                lval_add(x, lenv_resolve_atom(e, formals, cell, scope));
+                        }
+                }
+        }
+
+        return copy;
+}
+
+void lenv_capture(lenv * e, lval * func) {
+        func->env->parent = lenv_retain(e);
+
+        // out of scope ids, leave the symbols to the search by name
+        if (lenv_scopes == UINT_MAX) return;
+
+        unsigned int scope = ++lenv_scopes;
+        lval * body = lenv_resolve(e, func->formals, func->body, scope);
+
+        lval_del(func->body);
+
+        func->body = body;
+        func->env->scope = scope;
+}
+
+void lenv_print_stats(void) {
+        fprintf(stderr, "cache: globals %lu hits, %lu misses, version %u\n",
+                lenv_cache.hits, lenv_cache.misses, lenv_version);
+}
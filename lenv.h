@@ -4,28 +4,112 @@
 #include "base_types.h"
 #include "lval.h"
 
+typedef struct {
+        char * sym;
+        lval * val;
+} lenv_entry;
+
+/*
+ * Bindings are kept in insertion order in 'entries'; 'index' is an
+ * open-addressing (linear probing) table of entry positions keyed by
+ * the interned symbol's hash, with -1 marking an empty slot. Only the
+ * first 'indexed' entries are in it: the rest is added when the
+ * environment is next searched by name, so a call environment whose
+ * body only uses resolved symbols never builds one.
+ *
+ * Scoping is lexical: a lambda keeps the environment it was created in
+ * as the parent of its own, and every call gets a copy of that. An
+ * environment without a parent is a root; all the others are reference
+ * counted, since closures keep them alive after their call returns.
+ */
 struct lenv {
         lenv * parent;
+        int refs;
+        /* the lambda body this is a call environment of, 0 if none */
+        unsigned int scope;
+        /* bindings made by the call, before the body ran */
+        int fixed;
         int count;
-        lval ** vals;
-        char ** syms;
+        int capacity;
+        lenv_entry * entries;
+        int index_size;
+        int indexed;
+        int * index;
+        /* the collector's generation lists, see lgc.h */
+        lenv * gc_prev;
+        lenv * gc_next;
+        unsigned char gc_old;
+        unsigned char gc;       /* LVAL_F_GC_* while a collection runs */
+        /*
+         * set once the environment may outlive the form that made it,
+         * after which its tables and values stay out of the arena
+         */
+        unsigned char kept;
+        /* the arena chunks of 'entries' and 'index', see larena.h */
+        int entries_arena;
+        int index_arena;
 };
 
 /* lenv CONSTRUCOR */
 lenv * lenv_new(void);
 
-/* lenv DESTRUCTOR */
+/* lenv DESTRUCTOR, drops a reference */
 void lenv_del(lenv * e);
 
+/*
+ * lenv_del, handing the values bound in what goes to 'drop' instead
+ * of deleting them, so that lval_del can free them without recursing
+ */
+void lenv_del_into(lenv * e, void (*drop)(lval *));
+
+/* another reference to 'e', to be dropped with lenv_release */
+lenv * lenv_retain(lenv * e);
+void lenv_release(lenv * e);
+
 
+/* copy of the value bound to 'name', or an error */
 lval * lenv_get(lenv * e, lval * name);
 
+/*
+ * the bound value itself, still owned by the environment, or NULL.
+ * Globals used in lambda bodies are cached in the symbol until a
+ * global is redefined.
+ */
+lval * lenv_lookup(lenv * e, lval * name);
+
 /* define variable locally */
 void lenv_put(lenv * e, lval * name, lval * value);
 
 /* define variable globally */
 void lenv_def(lenv * e, lval * name, lval * value);
 
+/* room for 'capacity' bindings */
+void lenv_reserve(lenv * e, int capacity);
+
+/*
+ * append a binding of interned 'sym' to 'value' (taken over) without
+ * looking for an existing one, e.g. to bind arguments in formals order
+ */
+void lenv_bind(lenv * e, char * sym, lval * value);
+
 lenv * lenv_copy(lenv * e);
 
+/*
+ * move the tables of 'e' out of the arena and mark it kept (see
+ * larena.h); its values are left to lval_evacuate
+ */
+void lenv_evacuate(lenv * e);
+
+/* drop every binding, e.g. to break the cycles of an unreachable environment */
+void lenv_clear(lenv * e);
+
+/*
+ * close lambda 'func' over 'e', which it was created in, and resolve
+ * the symbols of its body to where they are bound from there
+ */
+void lenv_capture(lenv * e, lval * func);
+
+/* print global lookup cache counters to stderr (--cache-stats) */
+void lenv_print_stats(void);
+
 #endif
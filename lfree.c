@@ -0,0 +1,124 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lfree.h"
+
+/* a power of two */
+#define LFREE_QUEUE 4096
+/* smaller blocks are freed in place */
+#define LFREE_MIN_SIZE 4096
+
+/*
+ * 'head' is only written by the thread and 'tail' only by lfree; each
+ * side publishes its index with a release store and reads the other's
+ * with an acquire load, so a slot is never read before it was written
+ * or reused before it was read.
+ */
+static struct {
+        void * items[LFREE_QUEUE];
+        unsigned long head;
+        unsigned long tail;
+        int running;
+        int stop;
+        int sleeping;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        unsigned long queued;
+        unsigned long full;
+} lfree_queue = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static void lfree_wake(void) {
+        pthread_mutex_lock(&lfree_queue.lock);
+        pthread_cond_signal(&lfree_queue.wake);
+        pthread_mutex_unlock(&lfree_queue.lock);
+}
+
+static void * lfree_run(void * arg) {
+        unsigned long head = lfree_queue.head;
+
+        for (;;) {
+                unsigned long tail = __atomic_load_n(&lfree_queue.tail, __ATOMIC_ACQUIRE);
+
+                if (head != tail) {
+                        for (; head != tail; head++) {
+                                free(lfree_queue.items[head & (LFREE_QUEUE - 1)]);
+                                __atomic_store_n(&lfree_queue.head, head + 1, __ATOMIC_RELEASE);
+                        }
+                        continue;
+                }
+
+                if (__atomic_load_n(&lfree_queue.stop, __ATOMIC_ACQUIRE)) break;
+
+                /*
+                 * Say that we sleep before looking at the ring once more:
+                 * either that sees a block queued meanwhile, or lfree sees
+                 * 'sleeping' and wakes us up.
+                 */
+                pthread_mutex_lock(&lfree_queue.lock);
+                __atomic_store_n(&lfree_queue.sleeping, 1, __ATOMIC_SEQ_CST);
+
+                if (__atomic_load_n(&lfree_queue.tail, __ATOMIC_SEQ_CST) == head &&
+                        !__atomic_load_n(&lfree_queue.stop, __ATOMIC_SEQ_CST))
+                        pthread_cond_wait(&lfree_queue.wake, &lfree_queue.lock);
+
+                __atomic_store_n(&lfree_queue.sleeping, 0, __ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&lfree_queue.lock);
+        }
+
+        return NULL;
+}
+
+void lfree_start(void) {
+        if (lfree_queue.running) return;
+
+        lfree_queue.stop = 0;
+
+        if (pthread_create(&lfree_queue.thread, NULL, lfree_run, NULL) != 0) {
+                fprintf(stderr, "lispy: no free thread, freeing in place\n");
+                return;
+        }
+
+        lfree_queue.running = 1;
+}
+
+void lfree_stop(void) {
+        if (!lfree_queue.running) return;
+
+        __atomic_store_n(&lfree_queue.stop, 1, __ATOMIC_SEQ_CST);
+        lfree_wake();
+        pthread_join(lfree_queue.thread, NULL);
+
+        lfree_queue.running = 0;
+}
+
+void lfree(void * p, size_t size) {
+        if (!lfree_queue.running || size < LFREE_MIN_SIZE || p == NULL) {
+                free(p);
+                return;
+        }
+
+        unsigned long tail = lfree_queue.tail;
+        unsigned long head = __atomic_load_n(&lfree_queue.head, __ATOMIC_ACQUIRE);
+
+        if (tail - head == LFREE_QUEUE) {
+                lfree_queue.full++;
+                free(p);
+                return;
+        }
+
+        lfree_queue.items[tail & (LFREE_QUEUE - 1)] = p;
+        __atomic_store_n(&lfree_queue.tail, tail + 1, __ATOMIC_SEQ_CST);
+        lfree_queue.queued++;
+
+        if (__atomic_load_n(&lfree_queue.sleeping, __ATOMIC_SEQ_CST)) lfree_wake();
+}
+
+void lfree_print_stats(void) {
+        fprintf(stderr, "free: %lu blocks to the free thread, %lu freed in place as it was behind\n",
+                lfree_queue.queued, lfree_queue.full);
+}
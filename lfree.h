@@ -0,0 +1,38 @@
+#ifndef LFREE_H
+#define LFREE_H
+
+#include <stddef.h>
+
+/*
+ * Background freeing (--free-thread).
+ *
+ * Dropping the last reference to a value still happens on the
+ * evaluating thread: reference counts and the lval pool aren't shared
+ * between threads. The large memory blocks that end up unused, such as
+ * the cell storage of a dead list, environment tables and long strings,
+ * are passed to lfree instead of free. While the thread runs, lfree
+ * puts them on a single-producer, single-consumer ring, which the
+ * thread empties with free(). The ring takes no locks; the thread only
+ * sleeps on a condition variable when there is nothing to do.
+ *
+ * Smaller blocks are freed in place: malloc frees them quickly, and
+ * handing them to another thread would only make it contend for the
+ * allocator. So are blocks that find the ring full.
+ *
+ * Cell storage that holds nothing but fixnums and builtins is freed as
+ * a single block, without looking at the elements, so freeing such a
+ * list costs the evaluating thread nothing however long it is.
+ */
+
+void lfree_start(void);
+
+/* free everything still queued and join the thread */
+void lfree_stop(void);
+
+/* free(p) of a 'size' bytes block, on the background thread if it runs */
+void lfree(void * p, size_t size);
+
+/* print queueing counters to stderr (--free-stats) */
+void lfree_print_stats(void);
+
+#endif
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lgc.h"
+#include "lenv.h"
+#include "lpause.h"
+#include "lval.h"
+
+/* young environments alive at a time before they are collected */
+#define LGC_YOUNG_THRESHOLD 1000
+/* young collections before a full one is considered */
+#define LGC_FULL_AFTER 10
+
+int lgc_stats = 0;
+
+static struct {
+        lenv * young;
+        lenv * old;
+        /*
+         * environments in the young generation: call environments
+         * that are dropped when their call returns leave it again
+         */
+        long young_count;
+        /* since the last full collection */
+        long young_runs;
+        long promoted;
+        /* nodes found live by the last full collection */
+        long old_after_full;
+        int collecting;
+} gc;
+
+static struct {
+        unsigned long runs[2];
+        unsigned long freed;
+        lpause pauses;
+} totals;
+
+/* tracking */
+
+static lenv ** lgc_list(int old) {
+        return old ? &gc.old : &gc.young;
+}
+
+static void lgc_link(lenv * e, int old) {
+        lenv ** head = lgc_list(old);
+
+        e->gc_old = old;
+        e->gc_prev = NULL;
+        e->gc_next = *head;
+        if (*head != NULL) (*head)->gc_prev = e;
+        *head = e;
+}
+
+void lgc_track(lenv * e) {
+        lgc_link(e, 0);
+        gc.young_count++;
+}
+
+void lgc_untrack(lenv * e) {
+        if (!e->gc_old) gc.young_count--;
+
+        if (e->gc_prev != NULL) e->gc_prev->gc_next = e->gc_next;
+        else *lgc_list(e->gc_old) = e->gc_next;
+
+        if (e->gc_next != NULL) e->gc_next->gc_prev = e->gc_prev;
+}
+
+/*
+ * The nodes of a collection, in the order they were found. Each one is
+ * flagged LVAL_F_GC_SEEN in the node itself while the collection runs,
+ * and its reference count is lowered by the references it gets from
+ * the other nodes, which leaves the number of references from outside.
+ */
+typedef struct {
+        void * node;
+        lgc_kind kind;
+} lgc_node;
+
+static struct {
+        lgc_node * nodes;
+        int count;
+        int capacity;
+        int full;
+        /* nodes still to be traversed while marking */
+        lgc_node * stack;
+        int top;
+} scan;
+
+static unsigned char * lgc_flags(void * node, lgc_kind kind) {
+        switch (kind) {
+                case LGC_ENV: return &((lenv *) node)->gc;
+                case LGC_LVAL: return &((lval *) node)->flags;
+                case LGC_CELLS: return &((lcells *) node)->gc;
+        }
+
+        return NULL;
+}
+
+static long lgc_refs(lgc_node n) {
+        switch (n.kind) {
+                case LGC_ENV: return ((lenv *) n.node)->refs;
+                case LGC_LVAL: return ((lval *) n.node)->refs;
+                case LGC_CELLS: return ((lcells *) n.node)->refs;
+        }
+
+        return 0;
+}
+
+static void lgc_adjust(void * node, lgc_kind kind, int d) {
+        switch (kind) {
+                case LGC_ENV: ((lenv *) node)->refs += d; break;
+                case LGC_LVAL: ((lval *) node)->refs += d; break;
+                case LGC_CELLS: ((lcells *) node)->refs += d; break;
+        }
+}
+
+static void lgc_add(void * node, lgc_kind kind) {
+        if (scan.count == scan.capacity) {
+                scan.capacity = scan.capacity ? scan.capacity * 2 : 256;
+                scan.nodes = realloc(scan.nodes, sizeof(lgc_node) * scan.capacity);
+                scan.stack = realloc(scan.stack, sizeof(lgc_node) * scan.capacity);
+        }
+
+        *lgc_flags(node, kind) |= LVAL_F_GC_SEEN;
+
+        scan.nodes[scan.count].node = node;
+        scan.nodes[scan.count].kind = kind;
+        scan.count++;
+}
+
+/*
+ * whether the collection looks at 'node' at all: lambdas, lists that
+ * may lead to one, and the non-root environments and cell storage of
+ * the generations being collected. Anything else can't be part of a
+ * cycle, or is held from outside.
+ */
+static int lgc_examined(void * node, lgc_kind kind) {
+        if (kind == LGC_CELLS) return scan.full || !((lcells *) node)->old;
+
+        if (kind == LGC_ENV) {
+                lenv * e = node;
+                return e->parent != NULL && (scan.full || !e->gc_old);
+        }
+
+        lval * v = node;
+
+        if (LVAL_IS_FIXNUM(v) || (v->flags & LVAL_F_STATIC)) return 0;
+
+        if (v->type == LVAL_FUN) return !LVAL_IS_BUILTIN(v);
+
+        return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) &&
+                v->cells != NULL && v->cells->nested;
+}
+
+/* whether 'node' was added, without looking at anything else of it */
+static int lgc_seen(void * node, lgc_kind kind) {
+        if (kind == LGC_LVAL && LVAL_IS_FIXNUM(node)) return 0;
+        return *lgc_flags(node, kind) & LVAL_F_GC_SEEN;
+}
+
+static void lgc_traverse(lgc_node n, lgc_visit visit) {
+        switch (n.kind) {
+                case LGC_ENV: lenv_traverse(n.node, visit, NULL); break;
+                case LGC_LVAL: lval_traverse(n.node, visit, NULL); break;
+                case LGC_CELLS: lcells_traverse(n.node, visit, NULL); break;
+        }
+}
+
+/* a reference from a node: add what it points to, minus that reference */
+static void lgc_visit_count(void * node, lgc_kind kind, void * ctx) {
+        if (!lgc_seen(node, kind)) {
+                if (!lgc_examined(node, kind)) return;
+                lgc_add(node, kind);
+        }
+
+        lgc_adjust(node, kind, -1);
+}
+
+/* a reference from a live node */
+static void lgc_visit_mark(void * node, lgc_kind kind, void * ctx) {
+        if (!lgc_seen(node, kind)) return;
+
+        unsigned char * flags = lgc_flags(node, kind);
+
+        if (*flags & LVAL_F_GC_LIVE) return;
+
+        *flags |= LVAL_F_GC_LIVE;
+        scan.stack[scan.top].node = node;
+        scan.stack[scan.top].kind = kind;
+        scan.top++;
+}
+
+/* give back what lgc_visit_count took */
+static void lgc_visit_restore(void * node, lgc_kind kind, void * ctx) {
+        if (lgc_seen(node, kind)) lgc_adjust(node, kind, 1);
+}
+
+/* collection */
+
+void lgc_collect(int full) {
+        if (gc.collecting) return;
+        gc.collecting = 1;
+
+        double start = lpause_now();
+
+        scan.full = full;
+        scan.count = 0;
+
+        // the environments of the generations, then everything they lead to
+        for (int old = 0; old <= full; old++)
+                for (lenv * e = *lgc_list(old); e != NULL; e = e->gc_next)
+                        if (e->parent != NULL) lgc_add(e, LGC_ENV);
+
+        int envs = scan.count;
+
+        for (int n = 0; n < scan.count; n++)
+                lgc_traverse(scan.nodes[n], lgc_visit_count);
+
+        // mark from the nodes that are also held from outside
+        int live = 0;
+
+        for (int n = 0; n < scan.count; n++) {
+                unsigned char * flags = lgc_flags(scan.nodes[n].node, scan.nodes[n].kind);
+
+                if (lgc_refs(scan.nodes[n]) <= 0 || (*flags & LVAL_F_GC_LIVE)) continue;
+
+                *flags |= LVAL_F_GC_LIVE;
+                scan.stack[0] = scan.nodes[n];
+                scan.top = 1;
+
+                while (scan.top > 0) {
+                        live++;
+                        lgc_traverse(scan.stack[--scan.top], lgc_visit_mark);
+                }
+        }
+
+        for (int n = 0; n < scan.count; n++)
+                lgc_traverse(scan.nodes[n], lgc_visit_restore);
+
+        // storage is found after what holds it, so lists in lists are settled first
+        for (int n = scan.count - 1; n >= 0; n--) {
+                lgc_node m = scan.nodes[n];
+
+                if (m.kind == LGC_CELLS && (*lgc_flags(m.node, m.kind) & LVAL_F_GC_LIVE))
+                        lcells_settle(m.node);
+        }
+
+        /*
+         * Clear the flags, keep the unreachable environments around until
+         * all of them are emptied, and make live storage old: only full
+         * collections look into it again.
+         */
+        int freed = 0;
+
+        for (int n = 0; n < scan.count; n++) {
+                lgc_node m = scan.nodes[n];
+                unsigned char * flags = lgc_flags(m.node, m.kind);
+                int reached = *flags & LVAL_F_GC_LIVE;
+
+                *flags &= ~(LVAL_F_GC_SEEN | LVAL_F_GC_LIVE);
+
+                if (m.kind == LGC_CELLS && reached) ((lcells *) m.node)->old = 1;
+
+                if (m.kind == LGC_ENV && !reached) {
+                        ((lenv *) m.node)->refs++;
+                        scan.stack[freed++] = m;
+                }
+        }
+
+        for (int i = 0; i < freed; i++)
+                lenv_clear(scan.stack[i].node);
+
+        for (int i = 0; i < freed; i++)
+                lenv_del(scan.stack[i].node);
+
+        // the surviving environments grow old
+        while (gc.young != NULL) {
+                lenv * e = gc.young;
+
+                lgc_untrack(e);
+                lgc_link(e, 1);
+        }
+
+        if (full) {
+                gc.young_runs = 0;
+                gc.promoted = 0;
+                gc.old_after_full = live;
+        } else {
+                gc.young_runs++;
+                gc.promoted += live;
+        }
+
+        gc.young_count = 0;
+
+        double pause = lpause_now() - start;
+
+        totals.runs[full]++;
+        totals.freed += freed;
+        lpause_record(&totals.pauses, pause);
+
+        if (lgc_stats)
+                fprintf(stderr,
+                        "gc: %-5s %d envs, %d values scanned, %d envs freed, %d survived, %.3f ms\n",
+                        full ? "full" : "young", envs, scan.count - envs, freed, live, pause * 1e3);
+
+        gc.collecting = 0;
+}
+
+void lgc_poll(void) {
+        if (gc.young_count < LGC_YOUNG_THRESHOLD) return;
+
+        int full = gc.young_runs >= LGC_FULL_AFTER && gc.promoted > gc.old_after_full;
+
+        lgc_collect(full);
+}
+
+void lgc_print_stats(void) {
+        fprintf(stderr, "gc: %lu young, %lu full collections, %lu envs freed\n",
+                totals.runs[0], totals.runs[1], totals.freed);
+
+        lpause_print("gc", &totals.pauses);
+}
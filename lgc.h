@@ -0,0 +1,66 @@
+#ifndef LGC_H
+#define LGC_H
+
+#include "base_types.h"
+
+/*
+ * Cycle collector.
+ *
+ * Reference counting frees almost everything as soon as it is dropped,
+ * but not cycles, which always run through an environment: a lambda
+ * kept in (or below) the environment it closes over keeps that
+ * environment alive and the other way round.
+ *
+ * Every environment is tracked from lenv_new on, in one of two
+ * generations. A collection looks at the environments of the young
+ * generation (or of both, for a full one) and at the lambdas, lists and
+ * cell storage reachable from them, and counts how many references each
+ * of those gets from the others. What is left of a reference count is
+ * held from outside: the root environment, the evaluator stacks, C
+ * locals. Everything reachable from there is live; the environments
+ * that aren't are garbage and are emptied, which breaks their cycles
+ * and lets reference counting free the rest. Surviving environments
+ * and cell storage move to the old generation. Young collections don't
+ * look into it, so that long lists held by young environments aren't
+ * walked again and again; full ones run once it has about doubled.
+ * Lists that lead to no lambda are never walked again after the
+ * collection that finds so, not even by full ones (lcells_settle).
+ *
+ * Collections run at the start of lambda calls (lgc_poll), once enough
+ * young environments are alive. Most are the environments of calls
+ * and go when the call returns; those don't count. In arena mode, a
+ * form that leaves cycles in the arena is also collected when it ends.
+ */
+
+typedef enum {
+        LGC_ENV,
+        LGC_LVAL,
+        LGC_CELLS
+} lgc_kind;
+
+/* called for every reference a node holds; fixnums included */
+typedef void (*lgc_visit)(void * node, lgc_kind kind, void * ctx);
+
+/* the references held by each kind of node (lenv.c, lval.c) */
+void lenv_traverse(lenv * e, lgc_visit visit, void * ctx);
+void lval_traverse(lval * v, lgc_visit visit, void * ctx);
+void lcells_traverse(lcells * c, lgc_visit visit, void * ctx);
+/* clear 'nested' of live storage that leads to no lambda (lval.c) */
+void lcells_settle(lcells * c);
+
+/* print every collection, and totals on exit, to stderr (--gc-stats) */
+extern int lgc_stats;
+
+/* environments start in the young generation and leave when freed */
+void lgc_track(lenv * e);
+void lgc_untrack(lenv * e);
+
+/* collect if enough young environments outlived their calls */
+void lgc_poll(void);
+
+/* collect the young generation, or everything if 'full' */
+void lgc_collect(int full);
+
+void lgc_print_stats(void);
+
+#endif
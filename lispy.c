@@ -9,6 +9,12 @@
 #include "lenv.h"
 #include "builtin.h"
 #include "eval.h"
+#include "larena.h"
+#include "lfree.h"
+#include "lpool.h"
+#include "lsym.h"
+#include "lgc.h"
+#include "vm.h"
 
 #ifdef _WIN32
 
@@ -29,57 +35,12 @@ void add_history(char* unused) {}
 #include <editline/readline.h>
 #endif
 
-void lenv_add_builtin(lenv * e, char * name, lbuiltin fun) {
-        lval * name_symbol = lval_sym(name);
-        lval * value = lval_fun(fun, name);
-        lenv_put(e, name_symbol, value);
-        lval_del(name_symbol);
-        lval_del(value);
-}
-
 void lenv_add_builtins(lenv* e) {
-        /* List functions */
-        lenv_add_builtin(e, "list", builtin_list);
-        lenv_add_builtin(e, "head", builtin_head);
-        lenv_add_builtin(e, "tail", builtin_tail);
-        lenv_add_builtin(e, "join", builtin_join);
-        lenv_add_builtin(e, "eval", builtin_eval);
-
-        /* Mathematical functions */
-        lenv_add_builtin(e, "+", builtin_add);
-        lenv_add_builtin(e, "-", builtin_sub);
-        lenv_add_builtin(e, "*", builtin_mul);
-        lenv_add_builtin(e, "/", builtin_div);
-        lenv_add_builtin(e, "\%", builtin_mod);
-        lenv_add_builtin(e, "^", builtin_power);
-        lenv_add_builtin(e, "max", builtin_max);
-        lenv_add_builtin(e, "min", builtin_min);
-
-        /* Comparasion functions */
-        lenv_add_builtin(e, ">", builtin_gt);
-        lenv_add_builtin(e, "<", builtin_lt);
-        lenv_add_builtin(e, ">=", builtin_ge);
-        lenv_add_builtin(e, "<=", builtin_le);
-        lenv_add_builtin(e, "==", builtin_eq);
-        lenv_add_builtin(e, "!=", builtin_ne);
-
-        /* Variable functions */
-        lenv_add_builtin(e, "def", builtin_def);
-        lenv_add_builtin(e, "=", builtin_put);
-        lenv_add_builtin(e, "\\", builtin_lambda);
-        lenv_add_builtin(e, "fun", builtin_fun);
-
-        /* System functions */
-        lenv_add_builtin(e, "exit", builtin_exit);
-        lenv_add_builtin(e, "load", builtin_load);
-        lenv_add_builtin(e, "print", builtin_print);
-        lenv_add_builtin(e, "error", builtin_error);
-
-        /* logical functions */
-        lenv_add_builtin(e, "if", builtin_if);
-        lenv_add_builtin(e, "&&", builtin_logical_and);
-        lenv_add_builtin(e, "||", builtin_logical_or);
-        lenv_add_builtin(e, "!", builtin_logical_not);
+        for (int i = 0; i < builtin_count; i++) {
+                lval * name_symbol = lval_sym(builtin_values[i].builtin_name);
+                lenv_put(e, name_symbol, (lval *) &builtin_values[i]);
+                lval_del(name_symbol);
+        }
 }
 
 int main(int argc, char** argv) {
@@ -116,14 +77,40 @@ int main(int argc, char** argv) {
                 Lispy
         );
 
+        lsym_init();
+
         lenv * env = lenv_new();
         lenv_add_builtins(env);
 
-        if (argc >= 2) {
+        int pool_stats = 0;
+        int cache_stats = 0;
+        int free_thread = 0;
+        int files = 0;
+
+        for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--pool-stats") == 0) pool_stats = 1;
+                else if (strcmp(argv[i], "--cache-stats") == 0) cache_stats = 1;
+                else if (strcmp(argv[i], "--gc-stats") == 0) lgc_stats = 1;
+                else if (strcmp(argv[i], "--free-stats") == 0) lval_free_stats = 1;
+                else if (strcmp(argv[i], "--free-thread") == 0) free_thread = 1;
+                else if (strcmp(argv[i], "--arena") == 0) larena_enabled = 1;
+                else if (strncmp(argv[i], "--free-budget=", 14) == 0)
+                        lval_free_budget = atoi(argv[i] + 14);
+                else if (strcmp(argv[i], "--vm") == 0) vm_enabled = 1;
+                else if (strncmp(argv[i], "--stack-limit=", 14) == 0)
+                        eval_stack_limit = strtoul(argv[i] + 14, NULL, 10) << 20;
+                else files++;
+        }
+
+        if (free_thread) lfree_start();
+
+        if (files > 0) {
                 for (int i = 1; i < argc; i++) {
+                        if (strncmp(argv[i], "--", 2) == 0) continue;
+
                         lval * args = lval_add(lval_sexpr(), lval_str(argv[i]));
                         lval * x = builtin_load(env, args);
-                        if (x->type == LVAL_ERR) lval_println(x);
+                        if (LTYPE(x) == LVAL_ERR) lval_println(x);
                         lval_del(x);
                 }
         } else {
@@ -138,11 +125,15 @@ int main(int argc, char** argv) {
                         add_history(input);
 
                         if (mpc_parse("<stdin>", input , Lispy, &r)) {
+                                larena_begin();
+
                                 lval * x = lval_eval(env, lval_read(r.output));
-                                is_exit = (x->type == LVAL_ERR) && (x->errtype == L_ERROR_EXIT);
+                                is_exit = (LTYPE(x) == LVAL_ERR) && (x->errtype == L_ERROR_EXIT);
                                 lval_println(x);
                                 lval_del(x);
                                 mpc_ast_delete(r.output);
+
+                                larena_end();
                         } else {
                                 mpc_err_print(r.error);
                                 mpc_err_delete(r.error);
@@ -152,7 +143,20 @@ int main(int argc, char** argv) {
                 }
         }
 
+        // the globals go first, so that a last collection finds their cycles
+        lenv_clear(env);
+        lval_free_flush();
+        lgc_collect(1);
         lenv_del(env);
+        lval_free_flush();
+        lfree_stop();
+
+        if (pool_stats) lpool_print_stats();
+        if (pool_stats && larena_enabled) larena_print_stats();
+        if (cache_stats) lenv_print_stats();
+        if (lgc_stats) lgc_print_stats();
+        if (lval_free_stats) lval_free_print_stats();
+        if (lval_free_stats && free_thread) lfree_print_stats();
 
         mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
 
@@ -0,0 +1,50 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "lpause.h"
+
+double lpause_now(void) {
+        struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+
+        return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void lpause_record(lpause * p, double seconds) {
+        double ns = seconds * 1e9;
+        int b = ns > 1 ? (int) (log2(ns) * 4) : 0;
+
+        if (b >= LPAUSE_BUCKETS) b = LPAUSE_BUCKETS - 1;
+
+        p->buckets[b]++;
+        p->count++;
+        p->total += seconds;
+        if (seconds > p->max) p->max = seconds;
+}
+
+double lpause_quantile(lpause * p, double q) {
+        unsigned long seen = 0;
+
+        for (int b = 0; b < LPAUSE_BUCKETS; b++) {
+                seen += p->buckets[b];
+
+                // the upper end of the bucket, but never past the longest pause
+                if (seen >= q * p->count) {
+                        double upper = exp2((b + 1) / 4.0) * 1e-9;
+                        return upper < p->max ? upper : p->max;
+                }
+        }
+
+        return p->max;
+}
+
+void lpause_print(const char * name, lpause * p) {
+        fprintf(stderr,
+                "%s: %lu pauses, %.3f ms in all, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                name, p->count, p->total * 1e3,
+                lpause_quantile(p, 0.5) * 1e3, lpause_quantile(p, 0.99) * 1e3, p->max * 1e3);
+}
@@ -0,0 +1,30 @@
+#ifndef LPAUSE_H
+#define LPAUSE_H
+
+/*
+ * Pause times, e.g. of freeing or collecting, for the --*-stats
+ * options. Pauses are counted in a histogram with four buckets per
+ * power of two nanoseconds, so quantiles are upper bounds within 19%.
+ */
+
+#define LPAUSE_BUCKETS 160
+
+typedef struct {
+        unsigned long count;
+        double total;
+        double max;
+        unsigned long buckets[LPAUSE_BUCKETS];
+} lpause;
+
+/* monotonic time in seconds */
+double lpause_now(void);
+
+void lpause_record(lpause * p, double seconds);
+
+/* the pause 'q' (0 to 1) of all pauses are at most as long as, in seconds */
+double lpause_quantile(lpause * p, double q);
+
+/* one line to stderr: "<name>: <count> pauses, ..." */
+void lpause_print(const char * name, lpause * p);
+
+#endif
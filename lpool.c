@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lfree.h"
+#include "lpool.h"
+#include "lval.h"
+
+#define LPOOL_SLAB_SLOTS 256
+#define LPOOL_CHUNK_BYTES 4096
+#define LPOOL_CLASSES 4
+
+/* 16, 32, 64 and 128 bytes */
+#define LPOOL_MIN_CLASS 16
+#define LPOOL_MAX_CLASS (LPOOL_MIN_CLASS << (LPOOL_CLASSES - 1))
+
+#define LPOOL_TYPES (LVAL_QEXPR + 1)
+
+typedef union lpool_node {
+        union lpool_node * next;
+        lval v;
+} lpool_node;
+
+typedef struct lpool_slab {
+        struct lpool_slab * next;
+        lpool_node slots[LPOOL_SLAB_SLOTS];
+} lpool_slab;
+
+typedef struct lpool_chunk {
+        struct lpool_chunk * next;
+} lpool_chunk;
+
+typedef struct lpool_block {
+        struct lpool_block * next;
+} lpool_block;
+
+typedef struct {
+        unsigned long allocs;
+        unsigned long hits;
+        unsigned long carved;
+        unsigned long refills;
+} lpool_counters;
+
+static struct {
+        /* lval slots, carved from slabs of their own type */
+        lpool_slab * slabs[LPOOL_TYPES];
+        int slab_used[LPOOL_TYPES];
+        lpool_node * free_lists[LPOOL_TYPES];
+        lpool_counters lvals;
+        unsigned long lvals_by_type[LPOOL_TYPES];
+
+        /* byte size classes */
+        lpool_chunk * chunks[LPOOL_CLASSES];
+        size_t chunk_used[LPOOL_CLASSES];
+        lpool_block * blocks[LPOOL_CLASSES];
+        lpool_counters bytes[LPOOL_CLASSES];
+
+        unsigned long fallback;
+} pool;
+
+/* lval slots */
+
+#ifndef LISPY_NO_POOL
+
+static lval * lpool_carve(lval_type type) {
+        if (pool.slabs[type] == NULL || pool.slab_used[type] == LPOOL_SLAB_SLOTS) {
+                lpool_slab * slab = malloc(sizeof(lpool_slab));
+                slab->next = pool.slabs[type];
+                pool.slabs[type] = slab;
+                pool.slab_used[type] = 0;
+                pool.lvals.refills++;
+        }
+
+        pool.lvals.carved++;
+        return &pool.slabs[type]->slots[pool.slab_used[type]++].v;
+}
+
+lval * lpool_lval(lval_type type) {
+        pool.lvals.allocs++;
+        pool.lvals_by_type[type]++;
+
+        lpool_node * node = pool.free_lists[type];
+
+        if (node == NULL) return lpool_carve(type);
+
+        pool.free_lists[type] = node->next;
+        pool.lvals.hits++;
+
+        return &node->v;
+}
+
+void lpool_lval_free(lval * v) {
+        lpool_node * node = (lpool_node *) v;
+        lval_type type = v->type;
+
+        node->next = pool.free_lists[type];
+        pool.free_lists[type] = node;
+}
+
+#else
+
+lval * lpool_lval(lval_type type) {
+        pool.lvals.allocs++;
+        pool.lvals_by_type[type]++;
+        pool.fallback++;
+        return malloc(sizeof(lval));
+}
+
+void lpool_lval_free(lval * v) {
+        free(v);
+}
+
+#endif
+
+/* small byte buffers */
+
+static int lpool_class(size_t size) {
+        int c = 0;
+        size_t class_size = LPOOL_MIN_CLASS;
+
+        while (class_size < size) {
+                class_size <<= 1;
+                c++;
+        }
+
+        return c;
+}
+
+#ifndef LISPY_NO_POOL
+
+static void * lpool_carve_block(int c) {
+        size_t block_size = (size_t) LPOOL_MIN_CLASS << c;
+
+        if (pool.chunks[c] == NULL ||
+                pool.chunk_used[c] + block_size > LPOOL_CHUNK_BYTES) {
+                lpool_chunk * chunk = malloc(sizeof(lpool_chunk) + LPOOL_CHUNK_BYTES);
+                chunk->next = pool.chunks[c];
+                pool.chunks[c] = chunk;
+                pool.chunk_used[c] = 0;
+                pool.bytes[c].refills++;
+        }
+
+        char * start = (char *) (pool.chunks[c] + 1);
+        void * p = start + pool.chunk_used[c];
+
+        pool.chunk_used[c] += block_size;
+        pool.bytes[c].carved++;
+
+        return p;
+}
+
+void * lpool_alloc(size_t size) {
+        if (size > LPOOL_MAX_CLASS) {
+                pool.fallback++;
+                return malloc(size);
+        }
+
+        int c = lpool_class(size);
+        lpool_block * block = pool.blocks[c];
+
+        pool.bytes[c].allocs++;
+
+        if (block == NULL) return lpool_carve_block(c);
+
+        pool.blocks[c] = block->next;
+        pool.bytes[c].hits++;
+
+        return block;
+}
+
+void lpool_free(void * p, size_t size) {
+        if (size > LPOOL_MAX_CLASS) {
+                lfree(p, size);
+                return;
+        }
+
+        int c = lpool_class(size);
+        lpool_block * block = p;
+
+        block->next = pool.blocks[c];
+        pool.blocks[c] = block;
+}
+
+#else
+
+void * lpool_alloc(size_t size) {
+        if (size <= LPOOL_MAX_CLASS) pool.bytes[lpool_class(size)].allocs++;
+        pool.fallback++;
+        return malloc(size);
+}
+
+void lpool_free(void * p, size_t size) {
+        lfree(p, size);
+}
+
+#endif
+
+char * lpool_strdup(const char * s) {
+        size_t size = strlen(s) + 1;
+        char * copy = lpool_alloc(size);
+        memcpy(copy, s, size);
+        return copy;
+}
+
+void lpool_strfree(char * s) {
+        lpool_free(s, strlen(s) + 1);
+}
+
+void lpool_print_stats(void) {
+        fprintf(stderr,
+                "pool: lval    %lu allocs, %lu free-list hits, %lu carved, %lu slabs\n",
+                pool.lvals.allocs, pool.lvals.hits, pool.lvals.carved, pool.lvals.refills);
+
+        fprintf(stderr, "pool: lval   ");
+        for (int t = 0; t < LPOOL_TYPES; t++)
+                fprintf(stderr, " %s %lu%s", ltype_name(t), pool.lvals_by_type[t],
+                        t == LPOOL_TYPES - 1 ? "\n" : ",");
+
+        for (int c = 0; c < LPOOL_CLASSES; c++) {
+                fprintf(stderr,
+                        "pool: %3d B   %lu allocs, %lu free-list hits, %lu carved, %lu chunks\n",
+                        LPOOL_MIN_CLASS << c,
+                        pool.bytes[c].allocs, pool.bytes[c].hits,
+                        pool.bytes[c].carved, pool.bytes[c].refills);
+        }
+
+        fprintf(stderr, "pool: fallback mallocs %lu\n", pool.fallback);
+}
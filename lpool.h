@@ -0,0 +1,32 @@
+#ifndef LPOOL_H
+#define LPOOL_H
+
+#include <stddef.h>
+
+#include "base_types.h"
+
+/*
+ * Slab allocator behind every lval.
+ *
+ * lval structs are carved out of fixed-size slabs, one set of slabs
+ * per lval_type, and recycled through one free list per type. Small byte buffers (symbol, string and
+ * error text) go through power-of-two size classes; anything larger
+ * falls back to malloc.
+ *
+ * Building with -DLISPY_NO_POOL turns the pool into a thin malloc
+ * wrapper so that ASan can see every individual allocation.
+ */
+
+/* lval slots */
+lval * lpool_lval(lval_type type);
+void lpool_lval_free(lval * v);
+
+/* small byte buffers, freed with the size they were allocated with */
+void * lpool_alloc(size_t size);
+void lpool_free(void * p, size_t size);
+char * lpool_strdup(const char * s);
+void lpool_strfree(char * s);
+
+void lpool_print_stats(void);
+
+#endif
@@ -0,0 +1,292 @@
+#include <stdint.h>
+
+#include "lreduce.h"
+#include "lval.h"
+
+#if UINTPTR_MAX == UINT64_MAX
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LREDUCE_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LREDUCE_SSE2
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define LREDUCE_SSE42
+#endif
+#endif
+#endif
+
+#define LREDUCE_LOW ((uint64_t) 0xffffffff)
+#define LREDUCE_ZERO ((intptr_t) LVAL_FIXNUM(0))
+
+int lreduce_none(int argc, lval ** argv, long * out) {
+        return 0;
+}
+
+/*
+ * A fixnum word is 2x + 1, so the words of argv add up to
+ * 2 * sum + argc. They are added as signed high and unsigned low 32-bit
+ * halves in separate 64-bit lanes, which cannot overflow for any argc
+ * that fits in an int, and put back together at the end.
+ */
+int lreduce_sum(int argc, lval ** argv, long * out) {
+        uintptr_t tags = LVAL_FIXNUM_TAG;
+        uint64_t lo = 0;
+        int64_t hi = 0;
+        int i = 0;
+
+#if defined(LREDUCE_AVX2)
+        __m256i vtags = _mm256_set1_epi64x(LVAL_FIXNUM_TAG);
+        __m256i vlo = _mm256_setzero_si256();
+        __m256i vhi = _mm256_setzero_si256();
+        const __m256i low = _mm256_set1_epi64x(LREDUCE_LOW);
+
+        for (; i + 4 <= argc; i += 4) {
+                __m256i w = _mm256_loadu_si256((const __m256i *) (argv + i));
+                // the high halves, sign extended
+                __m256i h = _mm256_shuffle_epi32(w, _MM_SHUFFLE(3, 1, 3, 1));
+
+                vtags = _mm256_and_si256(vtags, w);
+                vlo = _mm256_add_epi64(vlo, _mm256_and_si256(w, low));
+                vhi = _mm256_add_epi64(vhi, _mm256_unpacklo_epi32(h, _mm256_srai_epi32(h, 31)));
+        }
+
+        uint64_t t[4], l[4];
+        int64_t h[4];
+
+        _mm256_storeu_si256((__m256i *) t, vtags);
+        _mm256_storeu_si256((__m256i *) l, vlo);
+        _mm256_storeu_si256((__m256i *) h, vhi);
+
+        for (int k = 0; k < 4; k++) {
+                tags &= t[k];
+                lo += l[k];
+                hi += h[k];
+        }
+#elif defined(LREDUCE_SSE2)
+        __m128i vtags = _mm_set1_epi64x(LVAL_FIXNUM_TAG);
+        __m128i vlo = _mm_setzero_si128();
+        __m128i vhi = _mm_setzero_si128();
+        const __m128i low = _mm_set1_epi64x(LREDUCE_LOW);
+
+        for (; i + 2 <= argc; i += 2) {
+                __m128i w = _mm_loadu_si128((const __m128i *) (argv + i));
+                // the high halves, sign extended
+                __m128i h = _mm_shuffle_epi32(w, _MM_SHUFFLE(3, 1, 3, 1));
+
+                vtags = _mm_and_si128(vtags, w);
+                vlo = _mm_add_epi64(vlo, _mm_and_si128(w, low));
+                vhi = _mm_add_epi64(vhi, _mm_unpacklo_epi32(h, _mm_srai_epi32(h, 31)));
+        }
+
+        uint64_t t[2], l[2];
+        int64_t h[2];
+
+        _mm_storeu_si128((__m128i *) t, vtags);
+        _mm_storeu_si128((__m128i *) l, vlo);
+        _mm_storeu_si128((__m128i *) h, vhi);
+
+        for (int k = 0; k < 2; k++) {
+                tags &= t[k];
+                lo += l[k];
+                hi += h[k];
+        }
+#endif
+
+        for (; i < argc; i++) {
+                uintptr_t w = (uintptr_t) argv[i];
+
+                tags &= w;
+                lo += w & LREDUCE_LOW;
+                hi += (int64_t) (intptr_t) w >> 32;
+        }
+
+        if (!(tags & LVAL_FIXNUM_TAG)) return 0;
+
+        // 2 * sum + argc == high * 2^32 + rest + argc
+        int64_t high = hi + (int64_t) (lo >> 32);
+        int64_t rest = (int64_t) (lo & LREDUCE_LOW) - argc;
+
+        // leave sums close to the limits of a long to the caller
+        if (high <= -((int64_t) 1 << 31) || high >= ((int64_t) 1 << 31)) return 0;
+
+        *out = high * ((int64_t) 1 << 31) + rest / 2;
+        return 1;
+}
+
+/* no SIMD here: SSE2 and AVX2 have no 64-bit multiply that reports overflow */
+int lreduce_product(int argc, lval ** argv, long * out) {
+        long x = 1;
+
+        for (int i = 0; i < argc; i++) {
+                if (!LVAL_IS_FIXNUM(argv[i])) return 0;
+
+                // the caller's fold reports the overflow
+                if (__builtin_mul_overflow(x, LVAL_FIXNUM_VALUE(argv[i]), &x)) return 0;
+        }
+
+        *out = x;
+        return 1;
+}
+
+/*
+ * 2x + 1 keeps the order of x, so the largest or smallest word is the
+ * largest or smallest fixnum
+ */
+static int lreduce_extreme(int argc, lval ** argv, long * out, int max) {
+        if (argc == 0) return 0;
+
+        uintptr_t tags = LVAL_FIXNUM_TAG;
+        intptr_t m = (intptr_t) argv[0];
+        int i = 0;
+
+#if defined(LREDUCE_AVX2)
+        __m256i vtags = _mm256_set1_epi64x(LVAL_FIXNUM_TAG);
+        __m256i vm = _mm256_set1_epi64x(m);
+
+        for (; i + 4 <= argc; i += 4) {
+                __m256i w = _mm256_loadu_si256((const __m256i *) (argv + i));
+                __m256i take = max ? _mm256_cmpgt_epi64(w, vm) : _mm256_cmpgt_epi64(vm, w);
+
+                vtags = _mm256_and_si256(vtags, w);
+                vm = _mm256_blendv_epi8(vm, w, take);
+        }
+
+        uint64_t t[4];
+        int64_t v[4];
+
+        _mm256_storeu_si256((__m256i *) t, vtags);
+        _mm256_storeu_si256((__m256i *) v, vm);
+
+        for (int k = 0; k < 4; k++) {
+                tags &= t[k];
+                if (max ? v[k] > m : v[k] < m) m = v[k];
+        }
+#elif defined(LREDUCE_SSE42)
+        __m128i vtags = _mm_set1_epi64x(LVAL_FIXNUM_TAG);
+        __m128i vm = _mm_set1_epi64x(m);
+
+        for (; i + 2 <= argc; i += 2) {
+                __m128i w = _mm_loadu_si128((const __m128i *) (argv + i));
+                __m128i take = max ? _mm_cmpgt_epi64(w, vm) : _mm_cmpgt_epi64(vm, w);
+
+                vtags = _mm_and_si128(vtags, w);
+                vm = _mm_blendv_epi8(vm, w, take);
+        }
+
+        uint64_t t[2];
+        int64_t v[2];
+
+        _mm_storeu_si128((__m128i *) t, vtags);
+        _mm_storeu_si128((__m128i *) v, vm);
+
+        for (int k = 0; k < 2; k++) {
+                tags &= t[k];
+                if (max ? v[k] > m : v[k] < m) m = v[k];
+        }
+#endif
+
+        for (; i < argc; i++) {
+                intptr_t w = (intptr_t) argv[i];
+
+                tags &= w;
+                if (max ? w > m : w < m) m = w;
+        }
+
+        if (!(tags & LVAL_FIXNUM_TAG)) return 0;
+
+        *out = LVAL_FIXNUM_VALUE((lval *) m);
+        return 1;
+}
+
+int lreduce_max(int argc, lval ** argv, long * out) {
+        return lreduce_extreme(argc, argv, out, 1);
+}
+
+int lreduce_min(int argc, lval ** argv, long * out) {
+        return lreduce_extreme(argc, argv, out, 0);
+}
+
+/* the number of zeros in argv, or -1 if not all of it are fixnums */
+static long lreduce_zeros(int argc, lval ** argv) {
+        uintptr_t tags = LVAL_FIXNUM_TAG;
+        long zeros = 0;
+        int i = 0;
+
+#if defined(LREDUCE_AVX2)
+        __m256i vtags = _mm256_set1_epi64x(LVAL_FIXNUM_TAG);
+        __m256i vzeros = _mm256_setzero_si256();
+        const __m256i zero = _mm256_set1_epi64x(LREDUCE_ZERO);
+
+        for (; i + 4 <= argc; i += 4) {
+                __m256i w = _mm256_loadu_si256((const __m256i *) (argv + i));
+
+                vtags = _mm256_and_si256(vtags, w);
+                // matches are -1
+                vzeros = _mm256_sub_epi64(vzeros, _mm256_cmpeq_epi64(w, zero));
+        }
+
+        uint64_t t[4];
+        int64_t z[4];
+
+        _mm256_storeu_si256((__m256i *) t, vtags);
+        _mm256_storeu_si256((__m256i *) z, vzeros);
+
+        for (int k = 0; k < 4; k++) {
+                tags &= t[k];
+                zeros += z[k];
+        }
+#elif defined(LREDUCE_SSE2)
+        __m128i vtags = _mm_set1_epi64x(LVAL_FIXNUM_TAG);
+        __m128i vzeros = _mm_setzero_si128();
+        const __m128i zero = _mm_set1_epi64x(LREDUCE_ZERO);
+
+        for (; i + 2 <= argc; i += 2) {
+                __m128i w = _mm_loadu_si128((const __m128i *) (argv + i));
+                // a 64-bit match is two 32-bit ones
+                __m128i eq = _mm_cmpeq_epi32(w, zero);
+
+                eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+
+                vtags = _mm_and_si128(vtags, w);
+                vzeros = _mm_sub_epi64(vzeros, eq);
+        }
+
+        uint64_t t[2];
+        int64_t z[2];
+
+        _mm_storeu_si128((__m128i *) t, vtags);
+        _mm_storeu_si128((__m128i *) z, vzeros);
+
+        for (int k = 0; k < 2; k++) {
+                tags &= t[k];
+                zeros += z[k];
+        }
+#endif
+
+        for (; i < argc; i++) {
+                tags &= (uintptr_t) argv[i];
+                zeros += (intptr_t) argv[i] == LREDUCE_ZERO;
+        }
+
+        return tags & LVAL_FIXNUM_TAG ? zeros : -1;
+}
+
+int lreduce_all(int argc, lval ** argv, long * out) {
+        long zeros = lreduce_zeros(argc, argv);
+
+        if (zeros < 0) return 0;
+
+        *out = zeros == 0;
+        return 1;
+}
+
+int lreduce_any(int argc, lval ** argv, long * out) {
+        long zeros = lreduce_zeros(argc, argv);
+
+        if (zeros < 0) return 0;
+
+        *out = zeros < argc;
+        return 1;
+}
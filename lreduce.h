@@ -0,0 +1,31 @@
+#ifndef LREDUCE_H
+#define LREDUCE_H
+
+#include "base_types.h"
+
+/*
+ * Single pass reductions over the arguments of variadic builtins.
+ *
+ * Each kernel succeeds only when every argument is a fixnum and the
+ * result fits in a long; it then stores the result in '*out', returns
+ * 1 and leaves argv alone, as fixnums need no freeing. Otherwise it
+ * returns 0 and the caller folds the arguments one by one, which also
+ * reports type errors.
+ *
+ * The kernels read the tagged words straight out of argv, 4 at a time
+ * with AVX2 or 2 with SSE2 (max and min need AVX2 or SSE4.2 for 64-bit
+ * compares), and fall back to plain C otherwise. Build with
+ * -mavx2 or -march=native to get the wider ones.
+ */
+
+int lreduce_none(int argc, lval ** argv, long * out);
+int lreduce_sum(int argc, lval ** argv, long * out);
+int lreduce_product(int argc, lval ** argv, long * out);
+int lreduce_max(int argc, lval ** argv, long * out);
+int lreduce_min(int argc, lval ** argv, long * out);
+
+/* 1 if every argument is non-zero (&&), or any is (||) */
+int lreduce_all(int argc, lval ** argv, long * out);
+int lreduce_any(int argc, lval ** argv, long * out);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lsym.h"
+
+#define LSYM_MIN_TABLE 64
+
+char * lsym_rest;
+char * lsym_if;
+
+static struct {
+        int count;
+        int size;
+        char ** names;
+} table;
+
+/* FNV-1a */
+static unsigned long lsym_hash(const char * s) {
+        unsigned long h = 2166136261UL;
+
+        while (*s) {
+                h ^= (unsigned char) *s++;
+                h *= 16777619UL;
+        }
+
+        return h;
+}
+
+static void lsym_insert(char * name) {
+        unsigned long mask = table.size - 1;
+        unsigned long i = LSYM_HASH(name) & mask;
+
+        while (table.names[i] != NULL) i = (i + 1) & mask;
+
+        table.names[i] = name;
+}
+
+/* keep the table at most half full */
+static void lsym_grow(void) {
+        if ((table.count + 1) * 2 <= table.size) return;
+
+        int old_size = table.size;
+        char ** old_names = table.names;
+
+        table.size = old_size ? old_size * 2 : LSYM_MIN_TABLE;
+        table.names = calloc(table.size, sizeof(char *));
+
+        for (int i = 0; i < old_size; i++)
+                if (old_names[i] != NULL) lsym_insert(old_names[i]);
+
+        free(old_names);
+}
+
+char * lsym_intern(const char * name) {
+        unsigned long hash = lsym_hash(name);
+
+        if (table.count > 0) {
+                unsigned long mask = table.size - 1;
+
+                for (unsigned long i = hash & mask; table.names[i] != NULL; i = (i + 1) & mask) {
+                        char * s = table.names[i];
+
+                        if (LSYM_HASH(s) == hash && strcmp(s, name) == 0)
+                                return s;
+                }
+        }
+
+        lsym_grow();
+
+        size_t len = strlen(name);
+        unsigned long * record = malloc(sizeof(unsigned long) + len + 1);
+        char * s = (char *) (record + 1);
+
+        record[0] = hash;
+        memcpy(s, name, len + 1);
+
+        lsym_insert(s);
+        table.count++;
+
+        return s;
+}
+
+void lsym_init(void) {
+        lsym_rest = lsym_intern("&");
+        lsym_if = lsym_intern("if");
+}
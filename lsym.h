@@ -0,0 +1,20 @@
+#ifndef LSYM_H
+#define LSYM_H
+
+/*
+ * Interned symbol names. Every distinct name is stored once and lives
+ * for the rest of the program, so symbols compare and copy as plain
+ * pointers. The FNV-1a hash of the name sits right before it.
+ */
+
+char * lsym_intern(const char * name);
+
+#define LSYM_HASH(s) (((unsigned long *) (s))[-1])
+
+/* names the evaluator looks for, interned by lsym_init */
+extern char * lsym_rest;        /* "&" */
+extern char * lsym_if;          /* "if" */
+
+void lsym_init(void);
+
+#endif
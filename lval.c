@@ -1,32 +1,146 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "lval.h"
+#include "larena.h"
+#include "lgc.h"
+#include "lpause.h"
+#include "lpool.h"
+#include "lsym.h"
+#include "vm.h"
+
+#define LVAL_MIN_CAPACITY 4
+
+static size_t lcells_size(int capacity) {
+        return sizeof(lcells) + sizeof(lval *) * capacity;
+}
+
+/* from the arena if 'arena' and a form runs in arena mode, see larena.h */
+static lcells * lcells_alloc(int capacity, int arena) {
+        int chunk = 0;
+        lcells * c = arena
+                ? larena_alloc(LARENA_CELLS, lcells_size(capacity), &chunk)
+                : malloc(lcells_size(capacity));
+
+        c->refs = 1;
+        c->heap = 0;
+        c->nested = 0;
+        c->old = 0;
+        c->gc = 0;
+        c->kept = 0;
+        c->capacity = capacity;
+        c->lo = 0;
+        c->hi = 0;
+        c->arena = chunk;
+        c->code = NULL;
+
+        return c;
+}
+
+static lcells * lcells_new(int capacity) {
+        return lcells_alloc(capacity, 1);
+}
+
+/* give back the block of 'c' alone */
+static void lcells_free(lcells * c) {
+        larena_free(c, lcells_size(c->capacity), c->arena);
+}
+
+/* 'c' with room for 'capacity' elements, keeping what fits of it */
+static lcells * lcells_resize(lcells * c, int capacity) {
+        int chunk = c->arena;
+
+        c = larena_realloc(LARENA_CELLS, c, lcells_size(c->capacity), lcells_size(capacity), &chunk);
+        c->arena = chunk;
+        c->capacity = capacity;
+
+        return c;
+}
+
+/* note that 'x' is stored in 'c' */
+static void lcells_store(lcells * c, lval * x) {
+        if (LVAL_IS_FIXNUM(x) || (x->flags & LVAL_F_STATIC)) return;
+
+        if (c->kept) lval_evacuate(x);
+
+        c->heap = 1;
+
+        if (x->type == LVAL_FUN || x->type == LVAL_SEXPR || x->type == LVAL_QEXPR)
+                c->nested = 1;
+}
+
+/*
+ * Values waiting to be deleted or compared. Nested lists are walked
+ * with this heap stack instead of C recursion, so their depth is only
+ * limited by memory, and so are chains of closures, whose environments
+ * hand their values to it too. Walks can nest; each one only touches
+ * the entries above its start.
+ */
+static struct {
+        lval ** items;
+        int count;
+        int capacity;
+} pending;
+
+static void pending_push(lval * v) {
+        if (pending.count == pending.capacity) {
+                pending.capacity = pending.capacity ? pending.capacity * 2 : 64;
+                pending.items = realloc(pending.items, sizeof(lval *) * pending.capacity);
+        }
+
+        pending.items[pending.count++] = v;
+}
+
+/* free the storage once unused, leaving its elements to lval_del */
+static void lcells_release(lcells * c) {
+        if (c == NULL || --c->refs > 0) return;
+
+        if (c->code != NULL) lcode_del(c->code);
+
+        // fixnums and builtins need no freeing, the block is all there is
+        if (c->heap)
+                for (int i = c->lo; i < c->hi; i++) pending_push(c->items[i]);
+
+        lcells_free(c);
+}
 
 /* lval CONSTRUCTORS */
 
+static lval * lval_new(lval_type type) {
+        lval * v = lpool_lval(type);
+
+        v->type = type;
+        v->flags = 0;
+        v->refs = 1;
+
+        return v;
+}
+
 lval * lval_num(long x) {
-        lval *v = malloc(sizeof(lval));
+        if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX)
+                return LVAL_FIXNUM(x);
+
+        lval * v = lval_new(LVAL_NUM);
 
-        v->type = LVAL_NUM;
         v->num = x;
 
         return v;
 }
 
 lval * lval_err(char * fmt, ...) {
-        lval *v = malloc(sizeof(lval));
+        lval * v = lval_new(LVAL_ERR);
 
-        v->type = LVAL_ERR;
+        v->errtype = L_ERROR_STANDARD;
 
         va_list va;
         va_start(va, fmt);
 
-        v->err = malloc(512);
+        char buffer[512];
 
-        vsnprintf(v->err, 511, fmt, va);
+        vsnprintf(buffer, sizeof(buffer), fmt, va);
 
-        v->err = realloc(v->err, strlen(v->err) + 1);
+        v->err = lpool_strdup(buffer);
 
         va_end(va);
 
@@ -34,60 +148,39 @@ lval * lval_err(char * fmt, ...) {
 }
 
 lval * lval_sym(char * symbol) {
-        lval *v = malloc(sizeof(lval));
+        lval * v = lval_new(LVAL_SYM);
 
-        v->type = LVAL_SYM;
-        v->sym = malloc(strlen(symbol) + 1);
-        strcpy(v->sym, symbol);
+        v->sym = lsym_intern(symbol);
+        v->scope = 0;
+        v->stamp = 0;
+        v->depth = 0;
+        v->slot = -1;
 
         return v;
 }
 
 lval * lval_sexpr(void) {
-        lval *v = malloc(sizeof(lval));
+        lval * v = lval_new(LVAL_SEXPR);
 
-        v->type = LVAL_SEXPR;
         v->count = 0;
         v->cell = NULL;
+        v->cells = NULL;
 
         return v;
 }
 
 lval * lval_qexpr(void) {
-        lval * v = malloc(sizeof(lval));
+        lval * v = lval_new(LVAL_QEXPR);
 
-        v->type = LVAL_QEXPR;
         v->count = 0;
         v->cell = NULL;
-
-        return v;
-}
-
-lval * lval_fun(lbuiltin fun, char * fun_name) {
-        lval * v = malloc(sizeof(lval));
-
-        v->type = LVAL_FUN;
-        v->builtin = fun;
-        v->builtin_name = NULL;
-
-        // builtin functions need a name
-        if (fun_name == NULL) {
-                v->builtin_name = NULL;
-        } else {
-                v->builtin_name = malloc(512);
-                strcpy(v->builtin_name, fun_name);
-                v->builtin_name = realloc(v->builtin_name, strlen(v->builtin_name) + 1);
-        }
+        v->cells = NULL;
 
         return v;
 }
 
 lval * lval_lambda(lval * formals, lval * body) {
-        lval * v = malloc(sizeof(lval));
-
-        v->type = LVAL_FUN;
-        v->builtin = NULL;
-        v->builtin_name = NULL;
+        lval * v = lval_new(LVAL_FUN);
 
         v->env = lenv_new();
 
@@ -104,119 +197,585 @@ lval * lval_exit_error(void) {
 }
 
 lval * lval_str(char * s) {
-        lval * v = malloc(sizeof(lval));
+        lval * v = lval_new(LVAL_STR);
 
-        v->type = LVAL_STR;
-        v->str = malloc(strlen(s) + 1);
-        strcpy(v->str, s);
+        v->str = lpool_strdup(s);
 
         return v;
 }
 
 /* lval DESTRUCTOR */
 
-void lval_del(lval * v) {
-        switch (v->type) {
-                case LVAL_NUM: break;
-                case LVAL_FUN:
-                        if (v->builtin == NULL) {
-                                lenv_del(v->env);
-                                lval_del(v->formals);
-                                lval_del(v->body);
+int lval_free_budget = 0;
+int lval_free_stats = 0;
+
+static lpause lval_free_pauses;
+
+/*
+ * Deferred freeing (lval_free_budget > 0): values whose reference is
+ * yet to be dropped, and a stack of storage whose elements are yet to
+ * be released, from lo up, linked through 'next'. 'busy' is set while
+ * working them off, when lval_del only adds to them.
+ */
+static struct {
+        lval ** items;
+        int count;
+        int capacity;
+        lcells * cells;
+        int busy;
+} dead;
+
+static void dead_push(lval * v) {
+        if (dead.count == dead.capacity) {
+                dead.capacity = dead.capacity ? dead.capacity * 2 : 64;
+                dead.items = realloc(dead.items, sizeof(lval *) * dead.capacity);
+        }
+
+        dead.items[dead.count++] = v;
+}
+
+/* the code is gone by now, which makes room for the link */
+static void dead_push_cells(lcells * c) {
+        c->next = dead.cells;
+        dead.cells = c;
+}
+
+/* drop the references in 'dead', at most 'budget' of them */
+static void lval_free_dead(int budget) {
+        dead.busy = 1;
+
+        for (int n = 0; n < budget; n++) {
+                if (dead.count == 0) {
+                        lcells * c = dead.cells;
+
+                        if (c == NULL) break;
+
+                        if (c->lo == c->hi) {
+                                dead.cells = c->next;
+                                lcells_free(c);
+                                continue;
                         }
-                        if (v->builtin_name != NULL)
-                                free(v->builtin_name);
-                        break;
-                case LVAL_ERR: free(v->err); break;
-                case LVAL_SYM: free(v->sym); break;
-                case LVAL_STR: free(v->str); break;
-                case LVAL_SEXPR:
-                case LVAL_QEXPR:
-                        for (int i = 0; i < v->count; i++) lval_del(v->cell[i]);
-                        free(v->cell);
-                        break;
+
+                        dead_push(c->items[c->lo++]);
+                }
+
+                lval * v = dead.items[--dead.count];
+
+                if (LVAL_IS_FIXNUM(v) || (v->flags & LVAL_F_STATIC)) continue;
+                if (--v->refs > 0) continue;
+
+                switch (v->type) {
+                        case LVAL_NUM: break;
+                        case LVAL_FUN:
+                                lenv_del_into(v->env, dead_push);
+                                dead_push(v->formals);
+                                dead_push(v->body);
+                                break;
+                        case LVAL_ERR: lpool_strfree(v->err); break;
+                        case LVAL_SYM: break;
+                        case LVAL_STR: lpool_strfree(v->str); break;
+                        case LVAL_SEXPR:
+                        case LVAL_QEXPR:
+                                if (v->cells != NULL && --v->cells->refs == 0) {
+                                        if (v->cells->code != NULL) lcode_del(v->cells->code);
+
+                                        if (v->cells->heap) dead_push_cells(v->cells);
+                                        else lcells_free(v->cells);
+                                }
+                                break;
+                }
+
+                lpool_lval_free(v);
+        }
+
+        dead.busy = 0;
+}
+
+/* free 'v', whose last reference is being dropped, and what only it held */
+static void lval_free(lval * v) {
+        if (lval_free_budget > 0) {
+                dead_push(v);
+                if (!dead.busy) lval_free_dead(lval_free_budget);
+                return;
         }
 
-        free(v);
+        int base = pending.count;
+
+        pending_push(v);
+
+        while (pending.count > base) {
+                v = pending.items[--pending.count];
+
+                if (LVAL_IS_FIXNUM(v) || (v->flags & LVAL_F_STATIC)) continue;
+                if (--v->refs > 0) continue;
+
+                switch (v->type) {
+                        case LVAL_NUM: break;
+                        case LVAL_FUN:
+                                lenv_del_into(v->env, pending_push);
+                                pending_push(v->formals);
+                                pending_push(v->body);
+                                break;
+                        case LVAL_ERR: lpool_strfree(v->err); break;
+                        case LVAL_SYM: break;
+                        case LVAL_STR: lpool_strfree(v->str); break;
+                        case LVAL_SEXPR:
+                        case LVAL_QEXPR:
+                                lcells_release(v->cells);
+                                break;
+                }
+
+                lpool_lval_free(v);
+        }
+}
+
+/* whether a pause is being timed, so that nested ones aren't */
+static int lval_freeing = 0;
+
+void lval_del(lval * v) {
+        // most calls only drop a reference
+        if (LVAL_IS_FIXNUM(v) || (v->flags & LVAL_F_STATIC)) return;
+        if (v->refs > 1) {
+                v->refs--;
+                return;
+        }
+
+        if (!lval_free_stats || lval_freeing) {
+                lval_free(v);
+                return;
+        }
+
+        double start = lpause_now();
+
+        lval_freeing = 1;
+        lval_free(v);
+        lval_freeing = 0;
+
+        lpause_record(&lval_free_pauses, lpause_now() - start);
+}
+
+void lval_free_step(void) {
+        if (dead.busy || (dead.count == 0 && dead.cells == NULL)) return;
+
+        if (!lval_free_stats || lval_freeing) {
+                lval_free_dead(lval_free_budget);
+                return;
+        }
+
+        double start = lpause_now();
+
+        lval_freeing = 1;
+        lval_free_dead(lval_free_budget);
+        lval_freeing = 0;
+
+        lpause_record(&lval_free_pauses, lpause_now() - start);
+}
+
+void lval_free_flush(void) {
+        while (dead.count > 0 || dead.cells != NULL)
+                lval_free_dead(INT_MAX);
+
+        free(dead.items);
+        dead.items = NULL;
+        dead.capacity = 0;
+}
+
+void lval_free_print_stats(void) {
+        lpause_print("free", &lval_free_pauses);
+}
+
+/* free 'argc' values, e.g. the arguments of an lbuiltin_argv */
+void lval_del_argv(int argc, lval ** argv) {
+        for (int i = 0; i < argc; i++) lval_del(argv[i]);
 }
 
 /* lval manipulation */
 
+/* index of cell[0] inside the storage */
+static int lval_first(lval * v) {
+        return v->cell - v->cells->items;
+}
+
+/* record that private storage owns exactly the visible elements */
+static void lval_sync(lval * v) {
+        v->cells->lo = lval_first(v);
+        v->cells->hi = lval_first(v) + v->count;
+}
+
+/* drop elements of private storage that are no longer visible */
+static void lval_trim(lval * v) {
+        lcells * c = v->cells;
+        int first = lval_first(v);
+
+        if (c->code != NULL) {
+                lcode_del(c->code);
+                c->code = NULL;
+        }
+
+        for (int i = c->lo; i < first; i++) lval_del(c->items[i]);
+        for (int i = first + v->count; i < c->hi; i++) lval_del(c->items[i]);
+
+        lval_sync(v);
+}
+
+/*
+ * make sure nobody else sees v's cells, copying them if needed; 'v'
+ * itself must be private
+ */
+lval * lval_unshare(lval * v) {
+        if (v->cells == NULL) return v;
+
+        if (v->cells->refs == 1) {
+                lval_trim(v);
+                return v;
+        }
+
+        lcells * c = lcells_new(v->count > LVAL_MIN_CAPACITY ? v->count : LVAL_MIN_CAPACITY);
+
+        for (int i = 0; i < v->count; i++)
+                c->items[i] = lval_copy(v->cell[i]);
+        c->hi = v->count;
+        c->heap = v->cells->heap;
+        c->nested = v->cells->nested;
+
+        // others still use the old storage, so this never frees it
+        v->cells->refs--;
+        v->cells = c;
+        v->cell = c->items;
+
+        return v;
+}
+
+/* resize private storage to hold exactly 'capacity' cells */
+static void lval_resize(lval * v, int capacity) {
+        if (v->cells == NULL) {
+                v->cells = lcells_new(capacity);
+                v->cell = v->cells->items;
+                return;
+        }
+
+        memmove(v->cells->items, v->cell, sizeof(lval *) * v->count);
+
+        v->cells = lcells_resize(v->cells, capacity);
+        v->cell = v->cells->items;
+
+        lval_sync(v);
+}
+
+/* grow cell storage so that it holds at least 'capacity' elements */
+lval * lval_reserve(lval * v, int capacity) {
+        v = lval_own(v);
+        lval_unshare(v);
+
+        int free_front = v->cells ? lval_first(v) : 0;
+        int total = v->cells ? v->cells->capacity : 0;
+
+        if (capacity <= total - free_front) return v;
+
+        lval_resize(v, capacity > total ? capacity : total);
+        return v;
+}
+
 lval * lval_add(lval * v, lval * x) {
-        v->count++;
-        v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-        v->cell[v->count - 1] = x;
+        v = lval_own(v);
+
+        lcells * c = v->cells;
+
+        // appending past the end of shared storage is invisible to others
+        if (c != NULL && c->refs > 1 &&
+                lval_first(v) + v->count == c->hi && c->hi < c->capacity) {
+                lcells_store(c, x);
+                v->cell[v->count++] = x;
+                c->hi++;
+                return v;
+        }
+
+        lval_unshare(v);
+        c = v->cells;
+
+        if (c == NULL) {
+                lval_resize(v, LVAL_MIN_CAPACITY);
+        } else if (lval_first(v) + v->count == c->capacity) {
+                // reuse the popped-off front if it is at least half the array
+                if (lval_first(v) >= c->capacity / 2)
+                        lval_resize(v, c->capacity);
+                else
+                        lval_resize(v, c->capacity * 2);
+        }
+
+        lcells_store(v->cells, x);
+        v->cell[v->count++] = x;
+        lval_sync(v);
+
         return v;
 }
 
 lval * lval_pop(lval * v, int i) {
+        // the ends of shared storage can be dropped without copying it
+        if (v->cells->refs > 1 && (i == 0 || i == v->count - 1)) {
+                lval * x = lval_copy(v->cell[i]);
+
+                if (i == 0) v->cell++;
+                v->count--;
+
+                return x;
+        }
+
+        lval_unshare(v);
+
         lval * x = v->cell[i];
 
-        memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+        // shift whichever side of the gap is shorter
+        if (i < v->count / 2) {
+                memmove(&v->cell[1], &v->cell[0], sizeof(lval *) * i);
+                v->cell++;
+        } else {
+                memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+        }
+
         v->count--;
+        lval_sync(v);
+
+        // give memory back only once the array is mostly empty
+        if (v->cells->capacity > LVAL_MIN_CAPACITY && v->count <= v->cells->capacity / 4)
+                lval_resize(v, v->cells->capacity / 2);
 
-        v->cell = realloc(v->cell, sizeof(lval *) * v->count);
         return x;
 }
 
+/* keep only elements [start, start + count) */
+lval * lval_slice(lval * v, int start, int count) {
+        if (count == v->count) return v;
+
+        v = lval_own(v);
+
+        v->cell += start;
+        v->count = count;
+
+        if (v->cells->refs == 1) lval_trim(v);
+
+        return v;
+}
+
 lval * lval_take(lval * v, int i) {
-        lval * x = lval_pop(v, i);
+        lval * x = lval_copy(v->cell[i]);
         lval_del(v);
         return x;
 }
 
 lval * lval_join(lval * x, lval * y) {
-        while (y->count)
-                x = lval_add(x, lval_pop(y, 0));
+        if (y->count == 0) {
+                lval_del(y);
+                return x;
+        }
+
+        x = lval_reserve(x, x->count + y->count);
+
+        if (x->cells->kept) lval_evacuate(y);
+
+        x->cells->heap |= y->cells->heap;
+        x->cells->nested |= y->cells->nested;
+
+        if (y->refs == 1 && y->cells->refs == 1) {
+                // drop what y doesn't show, then move the rest over and let y forget them
+                lval_trim(y);
+                memcpy(&x->cell[x->count], y->cell, sizeof(lval *) * y->count);
+                x->count += y->count;
+                y->count = 0;
+                lval_sync(y);
+        } else {
+                for (int i = 0; i < y->count; i++)
+                        x->cell[x->count++] = lval_copy(y->cell[i]);
+        }
 
+        lval_sync(x);
         lval_del(y);
+
         return x;
 }
 
+/* evacuation, see larena.h */
+
+/* give 'v' malloc'd storage with the same elements */
+static void lval_evacuate_cells(lval * v) {
+        lcells * c = v->cells;
+        lcells * copy = lcells_alloc(v->count > LVAL_MIN_CAPACITY ? v->count : LVAL_MIN_CAPACITY, 0);
+
+        copy->hi = v->count;
+        copy->heap = c->heap;
+        copy->nested = c->nested;
+
+        if (c->refs == 1) {
+                // nobody else sees the elements, so they move over
+                lval_trim(v);
+                memcpy(copy->items, v->cell, sizeof(lval *) * v->count);
+                lcells_free(c);
+        } else {
+                for (int i = 0; i < v->count; i++)
+                        copy->items[i] = lval_copy(v->cell[i]);
+                c->refs--;
+        }
+
+        v->cells = copy;
+        v->cell = copy->items;
+}
+
+/*
+ * Storage is replaced in place, so every holder of a value sees the
+ * same elements as before. Kept storage and environments hold nothing
+ * in the arena, so the walk stops at them; that is also what ends it
+ * when a lambda is stored in the environment it closes over.
+ */
+void lval_evacuate(lval * v) {
+        if (!larena_enabled) return;
+
+        int base = pending.count;
+
+        pending_push(v);
+
+        while (pending.count > base) {
+                v = pending.items[--pending.count];
+
+                if (LVAL_IS_FIXNUM(v) || (v->flags & LVAL_F_STATIC)) continue;
+
+                if (v->type == LVAL_FUN) {
+                        if (LVAL_IS_BUILTIN(v)) continue;
+
+                        // its own environment holds the arguments of a partial application
+                        for (lenv * e = v->env; e->parent != NULL && !e->kept; e = e->parent) {
+                                lenv_evacuate(e);
+
+                                for (int i = 0; i < e->count; i++)
+                                        pending_push(e->entries[i].val);
+                        }
+
+                        pending_push(v->formals);
+                        pending_push(v->body);
+                        continue;
+                }
+
+                if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) continue;
+                if (v->cells == NULL || v->cells->kept) continue;
+
+                if (v->cells->arena) lval_evacuate_cells(v);
+
+                lcells * c = v->cells;
+
+                c->kept = 1;
+
+                // all it owns, some of which other views may show
+                if (c->heap)
+                        for (int i = c->lo; i < c->hi; i++) pending_push(c->items[i]);
+        }
+}
+
+lcode * lval_code(lval * v) {
+        return v->cells != NULL ? v->cells->code : NULL;
+}
+
+void lval_set_code(lval * v, lcode * code) {
+        if (v->cells->code != NULL) lcode_del(v->cells->code);
+        v->cells->code = code;
+}
+
+/* collector traversal, see lgc.h */
+
+void lcells_traverse(lcells * c, lgc_visit visit, void * ctx) {
+        if (!c->nested) return;
+
+        for (int i = c->lo; i < c->hi; i++)
+                visit(c->items[i], LGC_LVAL, ctx);
+}
+
+void lcells_settle(lcells * c) {
+        if (!c->nested) return;
+
+        for (int i = c->lo; i < c->hi; i++) {
+                lval * x = c->items[i];
+
+                if (LVAL_IS_FIXNUM(x) || (x->flags & LVAL_F_STATIC)) continue;
+
+                if (x->type == LVAL_FUN && !LVAL_IS_BUILTIN(x)) return;
+
+                if ((x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) &&
+                        x->cells != NULL && x->cells->nested) return;
+        }
+
+        c->nested = 0;
+}
+
+/*
+ * formals and bodies too: a body is evaluated when the lambda is made,
+ * so it can hold lambdas, e.g. that of (\ {y} (list (\ {x} {u})))
+ */
+void lval_traverse(lval * v, lgc_visit visit, void * ctx) {
+        switch (v->type) {
+                case LVAL_FUN:
+                        if (LVAL_IS_BUILTIN(v)) break;
+
+                        visit(v->env, LGC_ENV, ctx);
+                        visit(v->formals, LGC_LVAL, ctx);
+                        visit(v->body, LGC_LVAL, ctx);
+                        break;
+                case LVAL_SEXPR:
+                case LVAL_QEXPR:
+                        if (v->cells != NULL) visit(v->cells, LGC_CELLS, ctx);
+                        break;
+                default: break;
+        }
+}
+
 lval * lval_copy(lval * v) {
-        lval * copy = malloc(sizeof(lval));
+        if (!LVAL_IS_FIXNUM(v) && !(v->flags & LVAL_F_STATIC)) v->refs++;
+        return v;
+}
+
+/*
+ * 'v' itself if nobody else holds it, otherwise a private copy that
+ * shares the parts of 'v', giving up one reference to 'v'
+ */
+lval * lval_own(lval * v) {
+        if (LVAL_IS_FIXNUM(v) || (v->flags & LVAL_F_STATIC) || v->refs == 1) return v;
 
-        copy->type = v->type;
+        lval * copy = lval_new(v->type);
+
+        copy->flags = v->flags;
 
         switch(v->type) {
                 case LVAL_NUM: copy->num = v->num; break;
                 case LVAL_FUN:
-                        copy->builtin = v->builtin;
+                        copy->env = lenv_copy(v->env);
+                        copy->formals = lval_copy(v->formals);
+                        copy->body = lval_copy(v->body);
+                        break;
+                case LVAL_SYM:
+                        copy->sym = v->sym;
+                        copy->scope = v->scope;
+                        copy->stamp = v->stamp;
 
-                        if (v->builtin_name != NULL) {
-                                copy->builtin_name = malloc(strlen(v->builtin_name) + 1);
-                                strcpy(copy->builtin_name, v->builtin_name);
+                        if (v->flags & LVAL_F_GLOBAL) {
+                                copy->cached = v->cached;
                         } else {
-                                copy->builtin_name = NULL;
-                        }
-
-                        if (v->builtin == NULL) {
-                                copy->env = lenv_copy(v->env);
-                                copy->formals = lval_copy(v->formals);
-                                copy->body = lval_copy(v->body);
+                                copy->depth = v->depth;
+                                copy->slot = v->slot;
                         }
                         break;
-                case LVAL_SYM:
-                        copy->sym = malloc(strlen(v->sym) + 1);
-                        strcpy(copy->sym, v->sym);
-                        break;
                 case LVAL_ERR:
-                        copy->err = malloc(strlen(v->err) + 1);
-                        strcpy(copy->err, v->err);
-                        break;
-                case LVAL_STR:
-                        copy->str = malloc(strlen(v->str) + 1);
-                        strcpy(copy->str, v->str);
+                        copy->err = lpool_strdup(v->err);
+                        copy->errtype = v->errtype;
                         break;
+                case LVAL_STR: copy->str = lpool_strdup(v->str); break;
                 case LVAL_SEXPR:
                 case LVAL_QEXPR:
                         copy->count = v->count;
-                        copy->cell = malloc(sizeof(lval *) * v->count);
-                        for (int i = 0; i < v->count; i++)
-                                copy->cell[i] = lval_copy(v->cell[i]);
+                        copy->cell = v->cell;
+                        copy->cells = v->cells;
+                        if (v->cells != NULL) v->cells->refs++;
                         break;
         }
 
+        v->refs--;
+
         return copy;
 }
 
@@ -234,29 +793,59 @@ char * ltype_name(lval_type t) {
 }
 
 int lval_eq(lval * x, lval * y) {
-        if (x->type != y->type) return 0;
-
-        switch (x->type)
-        {
-        case LVAL_NUM: return x->num == y->num;
-        case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-        case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-        case LVAL_STR: return (strcmp(x->str, y->str) == 0);
-        case LVAL_FUN:
-                if (x->builtin || y->builtin) {
-                        return x->builtin == y->builtin;
-                } else {
-                        return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+        int base = pending.count;
+        int equal = 1;
+
+        // compared in pairs
+        pending_push(x);
+        pending_push(y);
+
+        while (equal && pending.count > base) {
+                y = pending.items[--pending.count];
+                x = pending.items[--pending.count];
+
+                if (LTYPE(x) != LTYPE(y)) {
+                        equal = 0;
+                        break;
+                }
+
+                switch (LTYPE(x))
+                {
+                case LVAL_NUM: equal = LNUM(x) == LNUM(y); break;
+                case LVAL_ERR: equal = (strcmp(x->err, y->err) == 0); break;
+                case LVAL_SYM: equal = x->sym == y->sym; break;
+                case LVAL_STR: equal = (strcmp(x->str, y->str) == 0); break;
+                case LVAL_FUN:
+                        if (LVAL_IS_BUILTIN(x) || LVAL_IS_BUILTIN(y)) {
+                                equal = LVAL_IS_BUILTIN(x) && LVAL_IS_BUILTIN(y) &&
+                                        x->builtin == y->builtin;
+                        } else {
+                                pending_push(x->formals);
+                                pending_push(y->formals);
+                                pending_push(x->body);
+                                pending_push(y->body);
+                        }
+                        break;
+                case LVAL_QEXPR:
+                case LVAL_SEXPR:
+                        if (x->count != y->count) {
+                                equal = 0;
+                                break;
+                        }
+
+                        // two views of the same cells
+                        if (x->cell == y->cell) break;
+
+                        for (int i = x->count - 1; i >= 0; i--) {
+                                pending_push(x->cell[i]);
+                                pending_push(y->cell[i]);
+                        }
+                        break;
                 }
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-                if (x->count != y->count) return 0;
-                for (int i = 0; i < x->count; i++)
-                        if (!lval_eq(x->cell[i], y->cell[i]))
-                                return 0;
-                return 1;
         }
-        return 0;
+
+        pending.count = base;
+        return equal;
 }
 
 
@@ -297,6 +886,9 @@ lval * lval_read(mpc_ast_t * tag) {
         if (strstr(tag->tag, "sexpr")) x = lval_sexpr();
         if (strstr(tag->tag, "qexpr")) x = lval_qexpr();
 
+        // brackets and comments make this an upper bound
+        x = lval_reserve(x, tag->children_num);
+
         for (int i = 0; i < tag->children_num; i++) {
                 mpc_ast_t * child_tag = tag->children[i];
 
@@ -323,38 +915,78 @@ void lval_print_str(lval* v) {
         free(escaped);
 }
 
-void lval_expr_print(lval * v, char open, char close) {
-        putchar(open);
-
-        for (int i = 0; i < v->count; i++) {
-                lval_print(v->cell[i]);
-
-                if (i != v->count - 1) putchar(' ');
-        }
+/* elements of an expression, or the formals and body of a lambda */
+static int lval_print_count(lval * v) {
+        return LTYPE(v) == LVAL_FUN ? 2 : v->count;
+}
 
-        putchar(close);
+static lval * lval_print_child(lval * v, int i) {
+        if (LTYPE(v) == LVAL_FUN) return i == 0 ? v->formals : v->body;
+        return v->cell[i];
 }
 
+/* prints nested values with a heap stack of open expressions */
 void lval_print(lval * v) {
-        switch (v->type) {
-                case LVAL_NUM:   printf("%li", v->num); break;
-                case LVAL_ERR:   printf("Error: %s", v->err); break;
-                case LVAL_SYM:   printf("%s", v->sym); break;
-                case LVAL_STR:   lval_print_str(v); break;
-                case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-                case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
-                case LVAL_FUN:
-                        if (v->builtin != NULL)
-                                printf("<builtin: %s>", (v->builtin_name == NULL) ? "unknown" : v->builtin_name);
-                        else {
-                                printf("(\\ ");
-                                lval_print(v->formals);
-                                putchar(' ');
-                                lval_print(v->body);
-                                putchar(')');
+        struct { lval * v; int i; } * open = NULL;
+        int depth = 0;
+        int capacity = 0;
+
+        while (v != NULL) {
+                int is_open = 0;
+
+                switch (LTYPE(v)) {
+                        case LVAL_NUM:   printf("%li", LNUM(v)); break;
+                        case LVAL_ERR:   printf("Error: %s", v->err); break;
+                        case LVAL_SYM:   printf("%s", v->sym); break;
+                        case LVAL_STR:   lval_print_str(v); break;
+                        case LVAL_SEXPR: putchar('('); is_open = 1; break;
+                        case LVAL_QEXPR: putchar('{'); is_open = 1; break;
+                        case LVAL_FUN:
+                                if (LVAL_IS_BUILTIN(v)) {
+                                        printf("<builtin: %s>", (v->builtin_name == NULL) ? "unknown" : v->builtin_name);
+                                } else {
+                                        printf("(\\ ");
+                                        is_open = 1;
+                                }
+                                break;
+                }
+
+                if (is_open) {
+                        if (depth == capacity) {
+                                capacity = capacity ? capacity * 2 : 16;
+                                open = realloc(open, sizeof(*open) * capacity);
                         }
-                        break;
+
+                        open[depth].v = v;
+                        open[depth].i = 0;
+                        depth++;
+                }
+
+                // move on to the next element, closing finished expressions
+                v = NULL;
+
+                while (depth > 0) {
+                        lval * top = open[depth - 1].v;
+                        int i = open[depth - 1].i;
+
+                        if (i < lval_print_count(top)) {
+                                if (i > 0) putchar(' ');
+                                v = lval_print_child(top, i);
+                                open[depth - 1].i++;
+                                break;
+                        }
+
+                        switch (LTYPE(top)) {
+                                case LVAL_SEXPR: putchar(')'); break;
+                                case LVAL_QEXPR: putchar('}'); break;
+                                default: putchar(')'); break;
+                        }
+
+                        depth--;
+                }
         }
+
+        free(open);
 }
 
 void lval_println(lval * v) {
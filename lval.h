@@ -5,26 +5,162 @@
 #include "lenv.h"
 #include "mpc.h"
 
+#include <stdint.h>
+
+/*
+ * Small integers live directly in the lval pointer word: a set low bit
+ * marks a fixnum and the remaining bits hold the value. Only numbers
+ * outside [LVAL_FIXNUM_MIN, LVAL_FIXNUM_MAX] are boxed in a heap
+ * LVAL_NUM. Use LTYPE() and LNUM() instead of ->type and ->num on any
+ * value that may be a number.
+ */
+#define LVAL_FIXNUM_TAG 1
+#define LVAL_FIXNUM_MAX ((long) (INTPTR_MAX >> 1))
+#define LVAL_FIXNUM_MIN ((long) (INTPTR_MIN >> 1))
+
+#define LVAL_IS_FIXNUM(v) (((uintptr_t) (v)) & LVAL_FIXNUM_TAG)
+#define LVAL_FIXNUM(x) ((lval *) ((((uintptr_t) (x)) << 1) | LVAL_FIXNUM_TAG))
+#define LVAL_FIXNUM_VALUE(v) ((long) (((intptr_t) (v)) >> 1))
+
+#define LTYPE(v) (LVAL_IS_FIXNUM(v) ? LVAL_NUM : (v)->type)
+#define LNUM(v) (LVAL_IS_FIXNUM(v) ? LVAL_FIXNUM_VALUE(v) : (v)->num)
+
+/* lval flags */
+#define LVAL_F_BUILTIN 0x01
+#define LVAL_F_GLOBAL 0x02      /* a symbol resolved to the root environment */
+#define LVAL_F_ARGV 0x04        /* a builtin of type lbuiltin_argv */
+#define LVAL_F_STATIC 0x08      /* statically allocated and read-only, never copied or freed */
+/* set on the values a collection looks at (see lgc.h) until it ends */
+#define LVAL_F_GC_SEEN 0x10
+#define LVAL_F_GC_LIVE 0x20
+
+#define LVAL_IS_BUILTIN(v) ((v)->flags & LVAL_F_BUILTIN)
+
+/*
+ * Cell storage of S/Q-expressions.
+ *
+ * A private copy of a shared expression (lval_own) shares the storage
+ * instead of copying the elements, which makes slices (head, tail) of
+ * shared lists O(1). The storage owns the
+ * elements in items[lo, hi); each expression using it looks at a
+ * sub-range of that. Shared storage is never changed in place, except
+ * for appending past hi, which no other user can see. Anything else
+ * first takes a private copy (lval_unshare).
+ *
+ * 'code' caches the bytecode compiled from these cells (see vm.c); it
+ * is dropped as soon as private storage is changed in place.
+ *
+ * 'heap' is set once anything but a fixnum or a builtin is stored;
+ * without it, freeing the storage frees just the block (see lfree.h).
+ * 'nested' is set once a lambda or a list is stored, which is all the
+ * cycle collector looks for in here (see lgc.h); lists of plain values
+ * are skipped however long they are. A collection clears it again on
+ * storage that turns out to lead to no lambda, through any depth of
+ * lists. 'old' is set once the storage survived a collection, after
+ * which only full ones look into it.
+ * 'arena' is the number of the arena chunk the storage was carved from
+ * (see larena.h), or 0 if it was malloc'd. 'kept' is set once the
+ * storage may outlive the form that made it; it is then out of the
+ * arena, and so is everything stored into it (lval_evacuate).
+ */
+struct lcells {
+        int refs;
+        unsigned char heap;
+        unsigned char nested;
+        unsigned char old;
+        unsigned char gc;       /* LVAL_F_GC_* while a collection runs */
+        unsigned char kept;
+        int capacity;
+        int lo;
+        int hi;
+        int arena;
+        union {
+                lcode * code;
+                /* storage of which elements are still to be freed, see lval_del */
+                lcells * next;
+        };
+        lval * items[];
+};
+
+/*
+ * A type tag followed by the payload of that type only, 32 bytes on
+ * 64-bit targets. LVAL_FUN is either a builtin (LVAL_F_BUILTIN set, one
+ * of the static builtin_values) or a lambda, which never share fields.
+ *
+ * Values are reference counted: lval_copy shares the value and lval_del
+ * drops one reference. A value may be held by several owners, so it is
+ * only changed in place through the lval manipulation functions, which
+ * first take a private copy with lval_own when it is shared.
+ */
 struct lval {
-        lval_type type;
-
-        /* Basic */
-        long num;
-        char * err;
-        char * sym;
-        char * str;
-        l_error_type errtype;
-
-        /* Expression */
-        int count;
-        struct lval ** cell;
-
-        /* Function */
-        lbuiltin builtin;
-        char * builtin_name;
-        lenv * env;
-        lval * formals;
-        lval * body;
+        unsigned char type; /* lval_type */
+        unsigned char flags;
+        unsigned int refs;  /* not counted for fixnums and LVAL_F_STATIC */
+
+        union {
+                /* Number */
+                long num;
+
+                /* Error */
+                struct {
+                        char * err;
+                        l_error_type errtype;
+                };
+
+                /*
+                 * Symbol, an interned name (see lsym.h). Symbols in a
+                 * lambda body also say where the name was bound when
+                 * the lambda was created, see lenv_capture; 'scope' is
+                 * 0 for any other symbol. A global keeps its value as
+                 * of global version 'stamp' instead, see lenv_lookup.
+                 */
+                struct {
+                        char * sym;
+                        unsigned int scope;
+                        unsigned int stamp;
+                        union {
+                                struct {
+                                        int depth;
+                                        int slot;
+                                };
+                                lval * cached;
+                        };
+                };
+
+                /* String */
+                char * str;
+
+                /*
+                 * Expression. cell points at the first of 'count'
+                 * elements inside storage that may be shared with
+                 * other expressions, see lcells above.
+                 */
+                struct {
+                        int count;
+                        struct lval ** cell;
+                        lcells * cells;
+                };
+
+                /*
+                 * Builtin function. One taking an S-Expression frees it;
+                 * one taking argc and argv (LVAL_F_ARGV) frees the
+                 * values but not the array, which is the caller's.
+                 */
+                struct {
+                        union {
+                                lbuiltin builtin;
+                                lbuiltin_argv builtin_argv;
+                        };
+                        char * builtin_name;
+                };
+
+                /* Lambda */
+                struct {
+                        lenv * env;
+                        lval * formals;
+                        lval * body;
+                };
+        };
 };
 
 /* lval CONSTRUCTORS */
@@ -33,22 +169,57 @@ lval * lval_err(char * fmt, ...);
 lval * lval_sym(char * symbol);
 lval * lval_sexpr(void);
 lval * lval_qexpr(void);
-lval * lval_fun(lbuiltin fun, char * fun_name);
 lval * lval_lambda(lval * formals, lval * body);
 lval * lval_exit_error(void);
 lval * lval_str(char * s);
 
 /* lval DESTRUCTOR */
 void lval_del(lval * v);
+void lval_del_argv(int argc, lval ** argv);
 
-/* lval manipulation */
+/*
+ * Incremental freeing (--free-budget=N). With a budget, freeing a value
+ * frees at most that many values at once; what it held is freed a
+ * budget at a time by later lval_del calls and by lval_free_step, which
+ * runs at every lambda call. Values still waiting keep their references
+ * until then. 0 (the default) frees everything at once.
+ */
+extern int lval_free_budget;
+void lval_free_step(void);
+/* free everything still waiting */
+void lval_free_flush(void);
+
+/* time every lval_del that frees something (--free-stats) */
+extern int lval_free_stats;
+void lval_free_print_stats(void);
+
+/*
+ * lval manipulation. These change an expression in place and return
+ * it, which is a different lval if 'v' was shared; lval_pop needs 'v'
+ * to be private already (see lval_own).
+ */
+lval * lval_reserve(lval * v, int capacity);
 lval * lval_add(lval * v, lval * x);
 lval * lval_pop(lval * v, int i);
 lval * lval_take(lval * v, int i);
+lval * lval_slice(lval * v, int start, int count);
+lval * lval_unshare(lval * v);
 lval * lval_join(lval * x, lval * y);
 lval * lval_copy(lval * v);
+lval * lval_own(lval * v);
 int lval_eq(lval * x, lval * y);
 
+/*
+ * move what 'v' leads to out of the arena and mark it kept: the cell
+ * storage of lists, and the environments of lambdas up to the root,
+ * before 'v' is stored where it outlives the form (see larena.h)
+ */
+void lval_evacuate(lval * v);
+
+/* bytecode cached on an expression's cell storage, see vm.h */
+lcode * lval_code(lval * v);
+void lval_set_code(lval * v, lcode * code);
+
 char * ltype_name(lval_type t);
 
 /* CREATE lval from AST element */
@@ -59,7 +230,6 @@ lval * lval_read(mpc_ast_t * tag);
 /* lval printing functions */
 
 void lval_print_str(lval* v);
-void lval_expr_print(lval * v, char open, char close);
 void lval_print(lval * v);
 void lval_println(lval * v);
 
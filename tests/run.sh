@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Runs every tests/*.lispy on the tree walker and on the bytecode VM
+# and compares what it prints with tests/<name>.out. Prints a diff for
+# each run that doesn't match and exits non-zero if any didn't.
+#
+# usage: tests/run.sh [test.lispy ...]
+#
+# LISPY selects the interpreter binary and LISPY_FLAGS passes options to
+# it, e.g. LISPY_FLAGS=--arena to run every test in arena mode.
+
+LISPY=${LISPY:-./lispy}
+failed=0
+
+if [ $# -eq 0 ]; then
+        set -- tests/*.lispy
+fi
+
+for test in "$@"; do
+        expected="${test%.lispy}.out"
+
+        for mode in "" --vm; do
+                output=$(mktemp)
+
+                "$LISPY" $LISPY_FLAGS $mode "$test" > "$output" 2>&1
+
+                if ! diff -u "$expected" "$output"; then
+                        echo "FAIL $test $mode"
+                        failed=1
+                fi
+
+                rm -f "$output"
+        done
+done
+
+[ $failed -eq 0 ] && echo "All tests passed"
+exit $failed
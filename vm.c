@@ -0,0 +1,758 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "eval.h"
+#include "builtin.h"
+#include "lsym.h"
+
+int vm_enabled = 0;
+
+/* dispatch through a table of label addresses where the compiler has them */
+#if defined(__GNUC__) && !defined(LISPY_VM_SWITCH)
+#define VM_THREADED
+#endif
+
+/*
+ * Instructions and their operands. 'k' is an index into the constants,
+ * targets are instruction offsets.
+ */
+typedef enum {
+        OP_CONST,       /* k: push a copy of constant k */
+        OP_CONSTS,      /* k n: push copies of constants k to k + n - 1 */
+        OP_LOCAL,       /* k slot: push formal k, expected at 'slot' of the call's env */
+        OP_LOOKUP,      /* k: push symbol k, looked up with lenv_get */
+        OP_EMPTY,       /* push () */
+        OP_CALL,        /* n: call the function below the top n values */
+        OP_TAIL_CALL,   /* n: OP_CALL, but leave a lambda call to the caller of the code */
+        OP_IF,          /* k target: jump unless symbol k is bound to the builtin 'if' */
+        OP_JUMP_FALSE,  /* else end: pop the condition, jump to else on 0, keep an error and jump to end */
+        OP_JUMP,        /* target */
+        OP_RETURN
+} vm_op;
+
+struct lcode {
+        /* the cells this code was compiled from */
+        lval ** cell;
+        int count;
+
+        int * ops;
+        int ops_count;
+        int ops_capacity;
+
+        /* borrowed from the compiled tree, which outlives the code */
+        lval ** consts;
+        int consts_count;
+        int consts_capacity;
+
+        /* value stack size */
+        int depth;
+        int max_depth;
+};
+
+/* compiler */
+
+static int lcode_emit(lcode * c, int op) {
+        if (c->ops_count == c->ops_capacity) {
+                c->ops_capacity = c->ops_capacity ? c->ops_capacity * 2 : 16;
+                c->ops = realloc(c->ops, sizeof(int) * c->ops_capacity);
+        }
+
+        c->ops[c->ops_count] = op;
+        return c->ops_count++;
+}
+
+/* add the 'n' values at 'x' as constants, returning the index of the first */
+static int lcode_consts(lcode * c, lval ** x, int n) {
+        if (c->consts_count + n > c->consts_capacity) {
+                while (c->consts_count + n > c->consts_capacity)
+                        c->consts_capacity = c->consts_capacity ? c->consts_capacity * 2 : 8;
+
+                c->consts = realloc(c->consts, sizeof(lval *) * c->consts_capacity);
+        }
+
+        memcpy(&c->consts[c->consts_count], x, sizeof(lval *) * n);
+        c->consts_count += n;
+
+        return c->consts_count - n;
+}
+
+static int lcode_const(lcode * c, lval * x) {
+        return lcode_consts(c, &x, 1);
+}
+
+static void lcode_push(lcode * c, int n) {
+        c->depth += n;
+        if (c->depth > c->max_depth) c->max_depth = c->depth;
+}
+
+/* (if {cond} {then}) or (if {cond} {then} {else}) */
+static int vm_is_if(lval * v) {
+        if (v->cell[0]->sym != lsym_if) return 0;
+        if (v->count != 3 && v->count != 4) return 0;
+
+        for (int i = 1; i < v->count; i++)
+                if (LTYPE(v->cell[i]) != LVAL_QEXPR) return 0;
+
+        return 1;
+}
+
+static void vm_compile_list(lcode * c, lval * v, int tail);
+
+/* 'tail' is set when nothing but returning follows the expression */
+static void vm_compile(lcode * c, lval * x, int tail) {
+        if (LTYPE(x) == LVAL_SEXPR) {
+                vm_compile_list(c, x, tail);
+                return;
+        }
+
+        if (LTYPE(x) == LVAL_SYM) {
+                // a formal of the lambda, see lenv_capture
+                if (x->scope != 0 && !(x->flags & LVAL_F_GLOBAL) &&
+                        x->depth == 0 && x->slot != -1) {
+                        lcode_emit(c, OP_LOCAL);
+                        lcode_emit(c, lcode_const(c, x));
+                        lcode_emit(c, x->slot);
+                } else {
+                        lcode_emit(c, OP_LOOKUP);
+                        lcode_emit(c, lcode_const(c, x));
+                }
+        } else {
+                lcode_emit(c, OP_CONST);
+                lcode_emit(c, lcode_const(c, x));
+        }
+
+        lcode_push(c, 1);
+}
+
+/*
+ * Inline 'if' with a guard: when the symbol is rebound at run time the
+ * code falls back to calling it with the branches as arguments.
+ */
+static void vm_compile_if(lcode * c, lval * v, int tail) {
+        int depth = c->depth;
+        int k = lcode_const(c, v->cell[0]);
+
+        lcode_emit(c, OP_IF);
+        lcode_emit(c, k);
+        int generic = lcode_emit(c, 0);
+
+        vm_compile_list(c, v->cell[1], 0);
+        lcode_emit(c, OP_JUMP_FALSE);
+        int otherwise = lcode_emit(c, 0);
+        int end_cond = lcode_emit(c, 0);
+
+        c->depth = depth;
+        vm_compile_list(c, v->cell[2], tail);
+        lcode_emit(c, OP_JUMP);
+        int end_then = lcode_emit(c, 0);
+
+        c->ops[otherwise] = c->ops_count;
+        c->depth = depth;
+
+        if (v->count == 4) {
+                vm_compile_list(c, v->cell[3], tail);
+        } else {
+                lcode_emit(c, OP_EMPTY);
+                lcode_push(c, 1);
+        }
+
+        lcode_emit(c, OP_JUMP);
+        int end_else = lcode_emit(c, 0);
+
+        c->ops[generic] = c->ops_count;
+        c->depth = depth;
+
+        lcode_emit(c, OP_LOOKUP);
+        lcode_emit(c, k);
+        lcode_push(c, 1);
+
+        for (int i = 1; i < v->count; i++) {
+                lcode_emit(c, OP_CONST);
+                lcode_emit(c, lcode_const(c, v->cell[i]));
+                lcode_push(c, 1);
+        }
+
+        lcode_emit(c, OP_CALL);
+        lcode_emit(c, v->count - 1);
+        c->depth = depth + 1;
+
+        c->ops[end_cond] = c->ops_count;
+        c->ops[end_then] = c->ops_count;
+        c->ops[end_else] = c->ops_count;
+}
+
+/* the cells of 'v' as an S-Expression, see lval_eval_list */
+static void vm_compile_list(lcode * c, lval * v, int tail) {
+        if (v->count == 0) {
+                lcode_emit(c, OP_EMPTY);
+                lcode_push(c, 1);
+                return;
+        }
+
+        if (v->count == 1) {
+                vm_compile(c, v->cell[0], tail);
+                return;
+        }
+
+        if (LTYPE(v->cell[0]) == LVAL_SYM && vm_is_if(v)) {
+                vm_compile_if(c, v, tail);
+                return;
+        }
+
+        // the function is looked up before its arguments run, as in eval.c
+        for (int i = 0; i < v->count; ) {
+                int n = 0;
+
+                while (i + n < v->count &&
+                        LTYPE(v->cell[i + n]) != LVAL_SYM &&
+                        LTYPE(v->cell[i + n]) != LVAL_SEXPR)
+                        n++;
+
+                if (n < 2) {
+                        vm_compile(c, v->cell[i++], 0);
+                        continue;
+                }
+
+                // a run of values that evaluate to themselves, like a long argument list
+                lcode_emit(c, OP_CONSTS);
+                lcode_emit(c, lcode_consts(c, &v->cell[i], n));
+                lcode_emit(c, n);
+                lcode_push(c, n);
+
+                i += n;
+        }
+
+        lcode_emit(c, tail ? OP_TAIL_CALL : OP_CALL);
+        lcode_emit(c, v->count - 1);
+        c->depth -= v->count - 1;
+}
+
+static lcode * lcode_compile(lval * v) {
+        lcode * c = calloc(1, sizeof(lcode));
+
+        c->cell = v->cell;
+        c->count = v->count;
+
+        vm_compile_list(c, v, 1);
+        lcode_emit(c, OP_RETURN);
+
+        return c;
+}
+
+void lcode_del(lcode * c) {
+        free(c->ops);
+        free(c->consts);
+        free(c);
+}
+
+/* interpreter */
+
+typedef struct {
+        lcode * code;
+        int own_code;   /* not cached, freed with the frame */
+        int pc;
+        int base;       /* first value stack slot of the frame */
+        lenv * env;     /* held with lenv_retain, unless 'body' is NULL */
+        lval * body;    /* the lambda body or 'eval' or 'if' code being run, NULL at top level */
+        /* the branches of the 'if' whose condition is being run, else NULL */
+        lval * then;
+        lval * otherwise;
+} vm_frame;
+
+/* frames and values live on the heap, see eval_stack_limit */
+typedef struct {
+        vm_frame * frames;
+        int depth;
+        int frames_capacity;
+
+        lval ** values;
+        int sp;
+        int values_capacity;
+} vm_state;
+
+/* make room for 'frames' frames and 'values' values, 0 if over the limit */
+static int vm_reserve(vm_state * st, int frames, int values) {
+        if (frames <= st->frames_capacity && values <= st->values_capacity) return 1;
+
+        size_t fcap = st->frames_capacity;
+        size_t vcap = st->values_capacity;
+
+        while (fcap < frames) fcap = fcap ? fcap * 2 : 16;
+        while (vcap < values) vcap = vcap ? vcap * 2 : 64;
+
+        if (fcap * sizeof(vm_frame) + vcap * sizeof(lval *) > eval_stack_limit) {
+                fcap = frames > st->frames_capacity ? frames : st->frames_capacity;
+                vcap = values > st->values_capacity ? values : st->values_capacity;
+
+                if (fcap * sizeof(vm_frame) + vcap * sizeof(lval *) > eval_stack_limit)
+                        return 0;
+        }
+
+        if (fcap != st->frames_capacity) {
+                st->frames = realloc(st->frames, sizeof(vm_frame) * fcap);
+                st->frames_capacity = fcap;
+        }
+
+        if (vcap != st->values_capacity) {
+                st->values = realloc(st->values, sizeof(lval *) * vcap);
+                st->values_capacity = vcap;
+        }
+
+        return 1;
+}
+
+/* code for the cells of 'v', compiled on first use */
+static lcode * vm_code(lval * v, int * own) {
+        lcode * c = lval_code(v);
+
+        *own = 0;
+
+        if (c != NULL && c->cell == v->cell && c->count == v->count)
+                return c;
+
+        c = lcode_compile(v);
+
+        // another view of the same cells owns the cache; don't evict it
+        if (lval_code(v) != NULL)
+                *own = 1;
+        else
+                lval_set_code(v, c);
+
+        return c;
+}
+
+/* start running 'body' in 'env' on a new frame; 0 if over the limit */
+static int vm_push(vm_state * st, lval * v, lenv * env, lval * body) {
+        int own;
+        lcode * c = vm_code(v, &own);
+
+        if (!vm_reserve(st, st->depth + 1, st->sp + c->max_depth)) {
+                if (own) lcode_del(c);
+                return 0;
+        }
+
+        vm_frame * fr = &st->frames[st->depth++];
+
+        fr->code = c;
+        fr->own_code = own;
+        fr->pc = 0;
+        fr->base = st->sp;
+        fr->env = env;
+        fr->body = body;
+        fr->then = NULL;
+        fr->otherwise = NULL;
+
+        return 1;
+}
+
+/* run 'body' in 'env', both taken over, in place of the top frame; 0 if over the limit */
+static int vm_replace(vm_state * st, lval * body, lenv * env) {
+        int own;
+        lcode * c = vm_code(body, &own);
+        vm_frame * fr = &st->frames[st->depth - 1];
+
+        if (!vm_reserve(st, st->depth, fr->base + c->max_depth)) {
+                if (own) lcode_del(c);
+                return 0;
+        }
+
+        // nothing is left on the stack below code in tail position
+        fr = &st->frames[st->depth - 1];
+
+        lenv_release(fr->env);
+        lval_del(fr->body);
+        if (fr->own_code) lcode_del(fr->code);
+
+        fr->code = c;
+        fr->own_code = own;
+        fr->pc = 0;
+        fr->env = env;
+        fr->body = body;
+        st->sp = fr->base;
+
+        return 1;
+}
+
+static void vm_pop(vm_state * st) {
+        vm_frame * fr = &st->frames[--st->depth];
+
+        if (fr->body != NULL) {
+                lenv_release(fr->env);
+                lval_del(fr->body);
+        }
+
+        if (fr->then != NULL) lval_del(fr->then);
+        if (fr->otherwise != NULL) lval_del(fr->otherwise);
+        if (fr->own_code) lcode_del(fr->code);
+}
+
+/*
+ * Run 'body' in 'env', both taken over, on a new frame or, in tail
+ * position, on the current one. NULL, or an error if over the limit.
+ */
+static lval * vm_enter(vm_state * st, lval * body, lenv * env, int tail) {
+        int done = tail && st->frames[st->depth - 1].body != NULL ?
+                vm_replace(st, body, env) : vm_push(st, body, env, body);
+
+        if (done) return NULL;
+
+        lenv_release(env);
+        lval_del(body);
+        return lval_stack_overflow();
+}
+
+/*
+ * Given the condition of the 'if' on the top frame, go on to the
+ * branch it picks on the same frame. NULL when there is one, otherwise
+ * the value of the 'if'.
+ */
+static lval * vm_branch(vm_state * st, lval * cond) {
+        vm_frame * fr = &st->frames[st->depth - 1];
+        lval * then = fr->then;
+        lval * otherwise = fr->otherwise;
+
+        fr->then = NULL;
+        fr->otherwise = NULL;
+
+        if (LTYPE(cond) == LVAL_ERR) {
+                lval_del(then);
+                if (otherwise != NULL) lval_del(otherwise);
+                return cond;
+        }
+
+        // anything but a number counts as true, like in builtin_if
+        int is_false = LTYPE(cond) == LVAL_NUM && LNUM(cond) == 0;
+        lval * branch = is_false ? otherwise : then;
+
+        lval_del(cond);
+
+        if (is_false) lval_del(then);
+        else if (otherwise != NULL) lval_del(otherwise);
+
+        if (branch == NULL) return lval_sexpr();
+
+        return vm_enter(st, branch, lenv_retain(fr->env), 1);
+}
+
+/*
+ * Call 'f' on the 'argc' values at the top of the stack, which are
+ * taken over like 'owned' (freed after the call, may be NULL). Returns
+ * the value, or NULL when a frame for a lambda, 'eval' or 'if' was
+ * pushed or, in tail position, has replaced the current one.
+ */
+static lval * vm_invoke(vm_state * st, lval * f, lval * owned, int argc, int tail) {
+        lval ** argv = &st->values[st->sp - argc];
+        lenv * e = st->frames[st->depth - 1].env;
+        lval * result = NULL;
+
+        st->sp -= argc;
+
+        // report the first error, the function before its arguments
+        if (LTYPE(f) == LVAL_ERR) {
+                result = f;
+                owned = NULL;
+        }
+
+        for (int i = 0; result == NULL && i < argc; i++) {
+                if (LTYPE(argv[i]) == LVAL_ERR) {
+                        result = argv[i];
+                        argv[i] = NULL;
+                }
+        }
+
+        if (result == NULL && LTYPE(f) != LVAL_FUN) {
+                result = lval_err(
+                        "S-Expression starts with incorrect type. Got %s, Expected %s.",
+                        ltype_name(LTYPE(f)),
+                        ltype_name(LVAL_FUN)
+                );
+        }
+
+        if (result != NULL) {
+                for (int i = 0; i < argc; i++)
+                        if (argv[i] != NULL) lval_del(argv[i]);
+
+                if (owned != NULL) lval_del(owned);
+                return result;
+        }
+
+        // the arguments stay where they are, above sp, until taken over
+        if (LVAL_IS_BUILTIN(f)) {
+                if (owned != NULL) lval_del(owned);
+
+                // 'eval' and 'if' run their code on frames, not in their builtins
+                if (f->builtin_argv == builtin_eval &&
+                        argc == 1 && LTYPE(argv[0]) == LVAL_QEXPR)
+                        return vm_enter(st, argv[0], lenv_retain(e), tail);
+
+                if (f->builtin == builtin_if &&
+                        (argc == 2 || argc == 3) &&
+                        LTYPE(argv[0]) == LVAL_QEXPR &&
+                        LTYPE(argv[1]) == LVAL_QEXPR &&
+                        (argc == 2 || LTYPE(argv[2]) == LVAL_QEXPR)) {
+                        lval * then = argv[1];
+                        lval * otherwise = argc == 3 ? argv[2] : NULL;
+
+                        // the condition's frame goes on to the branch, see vm_branch
+                        result = vm_enter(st, argv[0], lenv_retain(e), 0);
+
+                        if (result != NULL) {
+                                lval_del(then);
+                                if (otherwise != NULL) lval_del(otherwise);
+                                return result;
+                        }
+
+                        st->frames[st->depth - 1].then = then;
+                        st->frames[st->depth - 1].otherwise = otherwise;
+                        return NULL;
+                }
+
+                return lval_call_builtin(e, f, argc, argv);
+        }
+
+        lenv * env;
+
+        result = lval_bind(f, argc, argv, &env);
+
+        if (result != NULL) {
+                if (owned != NULL) lval_del(owned);
+                return result;
+        }
+
+        // hold on to the body in case the call redefines 'f'
+        result = vm_enter(st, lval_copy(f->body), env, tail);
+
+        if (owned != NULL) lval_del(owned);
+        return result;
+}
+
+/* run frames until the one at 'depth' returns */
+static lval * vm_run(vm_state * st, int depth) {
+        vm_frame * fr;
+        lenv * e;
+        lval ** stack;
+        int * ops;
+        lval ** consts;
+        int pc;
+        int sp;
+
+        /* switch to the top frame, e.g. after a call or return */
+#define VM_LOAD() do { \
+                fr = &st->frames[st->depth - 1]; \
+                e = fr->env; \
+                stack = st->values; \
+                ops = fr->code->ops; \
+                consts = fr->code->consts; \
+                pc = fr->pc; \
+                sp = st->sp; \
+        } while (0)
+
+        /* leave the frame to vm_invoke or vm_pop */
+#define VM_SAVE() do { \
+                fr->pc = pc; \
+                st->sp = sp; \
+        } while (0)
+
+        VM_LOAD();
+
+#ifdef VM_THREADED
+        /* in vm_op order */
+        static void * labels[] = {
+                &&op_const, &&op_consts, &&op_local, &&op_lookup, &&op_empty,
+                &&op_call, &&op_tail_call, &&op_if, &&op_jump_false, &&op_jump,
+                &&op_return
+        };
+
+#define VM_NEXT goto *labels[ops[pc++]]
+#define VM_CASE(label, op) label:
+
+        VM_NEXT;
+#else
+#define VM_NEXT goto dispatch
+#define VM_CASE(label, op) case op:
+
+dispatch:
+        switch (ops[pc++]) {
+#endif
+
+        VM_CASE(op_const, OP_CONST) {
+                stack[sp++] = lval_copy(consts[ops[pc++]]);
+                VM_NEXT;
+        }
+
+        VM_CASE(op_consts, OP_CONSTS) {
+                lval ** k = &consts[ops[pc]];
+                int n = ops[pc + 1];
+
+                pc += 2;
+
+                for (int i = 0; i < n; i++)
+                        stack[sp++] = lval_copy(k[i]);
+
+                VM_NEXT;
+        }
+
+        VM_CASE(op_local, OP_LOCAL) {
+                lval * sym = consts[ops[pc]];
+                int slot = ops[pc + 1];
+
+                pc += 2;
+
+                if (e->scope == sym->scope && slot < e->count &&
+                        e->entries[slot].sym == sym->sym)
+                        stack[sp++] = lval_copy(e->entries[slot].val);
+                else
+                        stack[sp++] = lenv_get(e, sym);
+
+                VM_NEXT;
+        }
+
+        VM_CASE(op_lookup, OP_LOOKUP) {
+                stack[sp++] = lenv_get(e, consts[ops[pc++]]);
+                VM_NEXT;
+        }
+
+        VM_CASE(op_empty, OP_EMPTY) {
+                stack[sp++] = lval_sexpr();
+                VM_NEXT;
+        }
+
+        VM_CASE(op_call, OP_CALL)
+        VM_CASE(op_tail_call, OP_TAIL_CALL) {
+                int tail = ops[pc - 1] == OP_TAIL_CALL;
+                int argc = ops[pc++];
+                lval * f = stack[sp - argc - 1];
+
+                // the function's slot is where the result goes
+                memmove(&stack[sp - argc - 1], &stack[sp - argc], sizeof(lval *) * argc);
+                sp--;
+
+                VM_SAVE();
+
+                lval * x = vm_invoke(st, f, f, argc, tail);
+
+                if (x == NULL) {
+                        VM_LOAD();
+                } else {
+                        sp = st->sp;
+                        stack[sp++] = x;
+                }
+
+                VM_NEXT;
+        }
+
+        VM_CASE(op_if, OP_IF) {
+                lval * f = lenv_lookup(e, consts[ops[pc]]);
+
+                if (f != NULL && LTYPE(f) == LVAL_FUN && LVAL_IS_BUILTIN(f) &&
+                        f->builtin == builtin_if)
+                        pc += 2;
+                else
+                        pc = ops[pc + 1];
+
+                VM_NEXT;
+        }
+
+        VM_CASE(op_jump_false, OP_JUMP_FALSE) {
+                lval * cond = stack[sp - 1];
+
+                if (LTYPE(cond) == LVAL_ERR) {
+                        pc = ops[pc + 1];
+                        VM_NEXT;
+                }
+
+                // anything but a number counts as true, like in builtin_if
+                int is_false = LTYPE(cond) == LVAL_NUM && LNUM(cond) == 0;
+
+                lval_del(cond);
+                sp--;
+                pc = is_false ? ops[pc] : pc + 2;
+
+                VM_NEXT;
+        }
+
+        VM_CASE(op_jump, OP_JUMP) {
+                pc = ops[pc];
+                VM_NEXT;
+        }
+
+        VM_CASE(op_return, OP_RETURN) {
+                lval * x = stack[--sp];
+
+                st->sp = fr->base;
+
+                if (fr->then != NULL && (x = vm_branch(st, x)) == NULL) {
+                        VM_LOAD();
+                        VM_NEXT;
+                }
+
+                vm_pop(st);
+
+                if (st->depth == depth) return x;
+
+                VM_LOAD();
+                stack[sp++] = x;
+
+                VM_NEXT;
+        }
+
+#ifndef VM_THREADED
+        }
+
+        return NULL;
+#endif
+
+#undef VM_LOAD
+#undef VM_SAVE
+#undef VM_NEXT
+#undef VM_CASE
+}
+
+/* evaluation */
+
+lval * vm_eval(lenv * e, lval * v) {
+        if (LTYPE(v) == LVAL_SYM)
+                return lenv_get(e, v);
+
+        if (LTYPE(v) != LVAL_SEXPR)
+                return lval_copy(v);
+
+        if (v->count == 0) return lval_sexpr();
+
+        vm_state st = {0};
+
+        if (!vm_push(&st, v, e, NULL)) return lval_stack_overflow();
+
+        lval * x = vm_run(&st, 0);
+
+        free(st.frames);
+        free(st.values);
+
+        return x;
+}
+
+lval * vm_call(lenv * e, lval * func, int argc, lval ** argv) {
+        if (LVAL_IS_BUILTIN(func)) return lval_call_builtin(e, func, argc, argv);
+
+        lenv * env;
+        lval * x = lval_bind(func, argc, argv, &env);
+
+        if (x != NULL) return x;
+
+        vm_state st = {0};
+        lval * body = lval_copy(func->body);
+
+        if (!vm_push(&st, body, env, body)) {
+                lenv_del(env);
+                lval_del(body);
+                return lval_stack_overflow();
+        }
+
+        x = vm_run(&st, 0);
+
+        free(st.frames);
+        free(st.values);
+
+        return x;
+}
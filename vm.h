@@ -0,0 +1,31 @@
+#ifndef VM_H
+#define VM_H
+
+#include "base_types.h"
+#include "lval.h"
+#include "lenv.h"
+#include "eval.h"
+
+/*
+ * Bytecode compiler and stack VM, an alternative to the tree walker in
+ * eval.c selected with --vm.
+ *
+ * An S-Expression is compiled once into a flat list of instructions
+ * that refer back to the symbols and literals of the tree it came from.
+ * The code is cached on the expression's cell storage, so a function
+ * body is compiled on its first call and shared by every copy of it.
+ * 'if' with literal branches is compiled to conditional jumps, as long
+ * as the symbol still names the builtin when the code runs.
+ */
+
+extern int vm_enabled;
+
+/* evaluate 'v' without changing or freeing it, like lval_eval_tree */
+lval * vm_eval(lenv * e, lval * v);
+
+/* call lambda 'func' on 'argv' (taken over), running its body on the VM */
+lval * vm_call(lenv * e, lval * func, int argc, lval ** argv);
+
+void lcode_del(lcode * c);
+
+#endif